@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+#
+# Decode the typing analytics dumped by the firmware (HAVE_ANALYTICS).
+#
+# Usage: analytics.py DUMP
+#        analytics.py /dev/ttyACM0     (needs pyserial)
+#
+# If DUMP is a serial port, the dump is requested by sending 'd'.
+# Prints a heatmap of key presses (in matrix order) and percentiles
+# of the hold time and inter-key interval histograms.
+
+import os
+import stat
+import struct
+import sys
+
+SHADES = " .:-=+*#%@"
+
+def read_dump(path):
+    if stat.S_ISCHR(os.stat(path).st_mode):
+        import serial
+        with serial.Serial(path, timeout=1) as port:
+            port.reset_input_buffer()
+            port.write(b"d")
+            header = port.read(10)
+            numkeys, buckets, rollover, layers = sizes(header)
+            body = port.read(2 * (numkeys + 2 * buckets + rollover + layers))
+            return header + body
+    with open(path, "rb") as f:
+        return f.read()
+
+def sizes(header):
+    if len(header) < 10 or header[:3] != b"TKA":
+        sys.exit("analytics: not an analytics dump")
+    if header[3] != 1:
+        sys.exit("analytics: unknown dump version %d" % header[3])
+    numkeys = header[4] | (header[5] << 8)
+    return numkeys, header[7], header[8], header[9]
+
+def parse(data):
+    numkeys, buckets, rollover, layers = sizes(data)
+    cols = data[6]
+    counts = [numkeys, buckets, buckets, rollover, layers]
+    if len(data) < 10 + 2 * sum(counts):
+        sys.exit("analytics: dump is truncated")
+    values = struct.unpack_from("<%dH" % sum(counts), data, 10)
+    fields = []
+    for n in counts:
+        fields.append(list(values[:n]))
+        values = values[n:]
+    presses, hold, interval, rollover, layers = fields
+    return cols, presses, hold, interval, rollover, layers
+
+def bucket_range(n):
+    # bucket n counts times in [2^(n-1), 2^n) milliseconds
+    if n == 0:
+        return "0ms"
+    return "%d-%dms" % (1 << (n - 1), (1 << n) - 1)
+
+def percentile(histogram, p):
+    total = sum(histogram)
+    if total == 0:
+        return "-"
+    running = 0
+    for n, count in enumerate(histogram):
+        running += count
+        if running * 100 >= total * p:
+            return bucket_range(n)
+    return bucket_range(len(histogram) - 1)
+
+def heatmap(presses, cols):
+    top = max(presses) or 1
+    print("Key presses (matrix order, max %d)" % top)
+    for row in range(0, len(presses), cols):
+        cells = presses[row:row + cols]
+        print("  |" + "".join(SHADES[(c * (len(SHADES) - 1) + top - 1) // top] * 2 for c in cells) + "|"
+              + "  " + " ".join("%5d" % c for c in cells))
+    print()
+
+def report(name, histogram):
+    print("%s (%d samples)" % (name, sum(histogram)))
+    print("  p50 %s  p90 %s  p99 %s" % tuple(percentile(histogram, p) for p in (50, 90, 99)))
+    for n, count in enumerate(histogram):
+        if count:
+            print("  %-14s %6d" % (bucket_range(n), count))
+    print()
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: analytics.py DUMP|SERIALPORT")
+    cols, presses, hold, interval, rollover, layers = parse(read_dump(sys.argv[1]))
+    heatmap(presses, cols)
+    report("Hold time", hold)
+    report("Interval between presses", interval)
+    print("Keys already down at each press")
+    for n, count in enumerate(rollover):
+        print("  %s%-3d %6d" % (">=" if n == len(rollover) - 1 else "  ", n, count))
+    print()
+    print("Presses per layer")
+    for n, count in enumerate(layers):
+        if count:
+            print("  %-3d %6d" % (n, count))
+
+if __name__ == "__main__":
+    main()
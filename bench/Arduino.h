@@ -0,0 +1,51 @@
+#pragma once
+// Host stand-in for the parts of the Teensy core used by main.cpp
+// so that the firmware can be built and benchmarked on a PC.
+// The functions are defined in host.cpp.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef bool boolean;
+
+#define INPUT        0
+#define OUTPUT       1
+#define INPUT_PULLUP 2
+#define HIGH         1
+#define LOW          0
+
+// joystick pins (Teensy 3.0 numbering)
+#define A10 34
+#define A11 35
+
+void     pinMode(uint8_t pin, uint8_t mode);
+void     digitalWrite(uint8_t pin, uint8_t value);
+uint8_t  digitalRead(uint8_t pin);
+int      analogRead(uint8_t pin);
+void     delay(uint32_t ms);
+void     delayMicroseconds(uint32_t us);
+uint32_t millis();
+uint32_t micros();
+
+// Bytes written are kept in tx and bytes to be read are put in rx
+// by the host program (see host.cpp).
+struct Stream {
+    int    available();
+    int    read();
+    size_t write(uint8_t b);
+    size_t write(const uint8_t *buf, size_t len);
+    void   begin(long baud);
+
+    uint8_t  tx[256];
+    unsigned tx_len;
+    uint8_t  rx[1024];
+    unsigned rx_pos, rx_len;
+};
+extern Stream Serial, Serial1;
+
+struct usb_mouse_class {
+    void move(int8_t x, int8_t y, int8_t wheel = 0);
+    void set_buttons(uint8_t left, uint8_t middle, uint8_t right);
+};
+extern usb_mouse_class Mouse;
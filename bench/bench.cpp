@@ -0,0 +1,628 @@
+// Host benchmark of the firmware.
+//
+// main.cpp is built for the PC against the simulated Teensy in
+// host.cpp.  Canonical workloads are played into the key matrix one
+// scan at a time and the cost of each stage of loop() (scan_keyboard,
+// decode, send_keys and the pointer updates between scans) is measured.
+//
+// Output is one "name value" line per measurement (lines starting
+// with '#' are comments) which budget.py compares with budget.txt:
+//
+//     NAME.<workload>.<stage>   nanoseconds per scan
+//     NAME.leader.advance_leader nanoseconds per key after LEADER
+//     NAME.abbrev.expand_typed  nanoseconds per key typed as text
+//     NAME.keysN.changedK.<stage> nanoseconds per scan of N keys when K
+//                               keys change (with BENCH_MATRIX)
+//     NAME.table.<name>         bytes used by a keymap/DFA/string table
+//     NAME.strings.per_key      string pool and table as a percentage of
+//                               the bytes if each key had its own string
+//
+// NAME is BENCH_NAME, so that builds with different features or tables
+// (see the Makefile) can be checked together.  BENCH_WORKLOADS 0 leaves
+// out the workloads, for builds that only change the tables.
+// BENCH_MATRIX 1 only runs scanners of 72, 128 and 256 keys instead
+// of the keyboard (it needs NUMKEYS 256).
+//
+// Host timings only track the firmware roughly, so the budgets catch
+// algorithmic regressions rather than small changes.
+
+#include <time.h>
+#include <vector>
+
+#include "host.cpp"
+#include "main.cpp"
+
+#ifndef BENCH_NAME
+#define BENCH_NAME "bench"
+#endif
+#ifndef BENCH_MATRIX
+#define BENCH_MATRIX 0
+#endif
+#ifndef BENCH_WORKLOADS
+#define BENCH_WORKLOADS !BENCH_MATRIX
+#endif
+
+#if BENCH_WORKLOADS
+////////////////////////////////////////////////////////////////
+// Workloads
+////////////////////////////////////////////////////////////////
+
+struct frame {
+    uint32_t rows[MATRIX_ROWS];
+};
+
+// connect the pins of the keys pressed in frame
+static void load_frame(const frame &f) {
+    for(int row = 0; row < MATRIX_ROWS; ++row) {
+        uint64_t pins = 0;
+        for(int col = 0; col < MATRIX_COLS; ++col) {
+            if (f.rows[row] & (1u << col)) {
+                pins |= (uint64_t)1 << keyboard_pins::cols[col];
+            }
+        }
+        sim_pins[keyboard_pins::rows[row]] = pins;
+    }
+}
+
+struct workload {
+    const char *name;
+    std::vector<frame> scans;
+    frame now;
+
+    explicit workload(const char *n) : name(n), now() {}
+
+    void press(int raw) {
+        if (raw >= 0) {
+            now.rows[raw / MATRIX_COLS] |= (1u << (raw % MATRIX_COLS));
+        }
+    }
+    void release(int raw) {
+        if (raw >= 0) {
+            now.rows[raw / MATRIX_COLS] &= ~(1u << (raw % MATRIX_COLS));
+        }
+    }
+    void tick(int n = 1) {
+        while (n-- > 0) {
+            scans.push_back(now);
+        }
+    }
+    // release everything and let the debounce timeouts run out
+    void finish() {
+        now = frame();
+        tick(DEBOUNCE_TIMEOUT + 2);
+    }
+};
+
+// first key with keycode on layer (or -1)
+static int find_raw(int layer, uint16_t keycode) {
+    for(int raw = 0; raw < MATRIX_KEYS; ++raw) {
+        if (layers[layer][raw] == keycode) {
+            return raw;
+        }
+    }
+    return -1;
+}
+
+// Qwerty characters -> keycode (and whether shift is needed)
+static const char qwerty_chars[]   = "`1234567890-=qwertyuiop[]\\asdfghjkl;'zxcvbnm,./ ";
+static const char qwerty_shifted[] = "~!@#$%^&*()_+QWERTYUIOP{}|ASDFGHJKL:\"ZXCVBNM<>? ";
+static const uint16_t qwerty_keys[] = {
+    KEY_TILDE, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8, KEY_9, KEY_0, KEY_MINUS, KEY_EQUAL,
+    KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I, KEY_O, KEY_P, KEY_LEFT_BRACE, KEY_RIGHT_BRACE, KEY_BACKSLASH,
+    KEY_A, KEY_S, KEY_D, KEY_F, KEY_G, KEY_H, KEY_J, KEY_K, KEY_L, KEY_SEMICOLON, KEY_QUOTE,
+    KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B, KEY_N, KEY_M, KEY_COMMA, KEY_PERIOD, KEY_SLASH,
+    SPACE_SHIFT,
+};
+
+// the host translates Qwerty keys to Dvorak (see mkdfa.py)
+static const char dvorak_chars[] = "[]',.pyfgcrl/=aoeuidhtns-;qjkxbmwvz{}\"<>PYFGCRL?+AOEUIDHTNS_:QJKXBMWVZ";
+static const char dvorak_keys[]  = "-=qwertyuiop[]asdfghjkl;'zxcvbnm,./_+QWERTYUIOP{}ASDFGHJKL:\"ZXCVBNM<>?";
+
+// type text as fast overlapping key presses (two keys held at once)
+static void type_text(workload &w, const char *text) {
+    int lshift = find_raw(0, LSHIFT);
+    int prev   = -1;
+    for(const char *p = text; *p; ++p) {
+        char ch = *p;
+        const char *d = strchr(dvorak_chars, ch);
+        if (d) {
+            ch = dvorak_keys[d - dvorak_chars];
+        }
+        const char *q = strchr(qwerty_chars, ch);
+        boolean shift = false;
+        if (!q) {
+            q = strchr(qwerty_shifted, ch);
+            shift = true;
+        }
+        if (!q) {
+            continue;
+        }
+        int raw = find_raw(0, qwerty_keys[q - (shift ? qwerty_shifted : qwerty_chars)]);
+        if (shift) {
+            w.release(prev);
+            w.press(lshift);
+            w.tick();
+        }
+        w.press(raw);
+        w.tick(2);
+        w.release(prev);
+        if (shift) {
+            w.release(raw);
+            w.release(lshift);
+            raw = -1;
+        }
+        w.tick();
+        prev = raw;
+    }
+    w.finish();
+}
+
+static workload idle_workload() {
+    workload w("idle");
+    w.tick(1000);
+    return w;
+}
+
+static workload typing_workload() {
+    workload w("typing");
+    for(int i = 0; i < 10; ++i) {
+        type_text(w, "the quick brown fox jumps over the lazy dog; x -> y <=> z ");
+    }
+    return w;
+}
+
+// ten keys at a time, pressed and released together
+static workload rollover_workload() {
+    workload w("rollover");
+    std::vector<int> keys;
+    for(int raw = 0; raw < MATRIX_KEYS; ++raw) {
+        if (IS_NORMAL(layers[0][raw])) {
+            keys.push_back(raw);
+        }
+    }
+    for(int i = 0; i < 100; ++i) {
+        for(int j = 0; j < 10; ++j) {
+            w.press(keys[(i * 7 + j * 5) % keys.size()]);
+        }
+        w.tick(3);
+        w.finish();
+    }
+    return w;
+}
+
+// tap every Unicode character and string key on a chorded layer
+static void tap_unicode(workload &w, const int *hold, int layer) {
+    for(; *hold >= 0; ++hold) {
+        w.press(*hold);
+    }
+    w.tick();
+    for(int raw = 0; raw < MATRIX_KEYS; ++raw) {
+        uint16_t keycode = layers[layer][raw];
+        if (IS_UNICODE(keycode) || IS_STRING(keycode)) {
+            w.press(raw);
+            w.tick(2);
+            w.release(raw);
+            w.tick();
+        }
+    }
+    w.finish();
+}
+
+static workload unicode_workload() {
+    workload w("unicode");
+    int fn[]     = { find_raw(0, RCTRL), -1 };
+    int alt_fn[] = { find_raw(0, RCTRL), find_raw(0, LALT), -1 };
+    for(int i = 0; i < 5; ++i) {
+        tap_unicode(w, fn, 1);
+        tap_unicode(w, alt_fn, 4);
+    }
+    return w;
+}
+
+// modifier taps and modifiers rolled over letters
+// (with HAVE_TAPPERS, the space bar is a tapping shift)
+static workload tapper_workload() {
+    workload w("tapper");
+    const uint16_t mods[] = { LSHIFT, LCTRL, SPACE_SHIFT, LGUI };
+    const uint16_t keys[] = { KEY_A, KEY_S, KEY_D, KEY_F };
+    for(int i = 0; i < 100; ++i) {
+        int mod = find_raw(0, mods[i % 4]);
+        int key = find_raw(0, keys[i % 4]);
+        w.press(mod); // tap
+        w.tick();
+        w.release(mod);
+        w.tick();
+        w.press(mod); // roll
+        w.tick();
+        w.press(key);
+        w.tick();
+        w.release(mod);
+        w.tick();
+        w.release(key);
+        w.tick();
+    }
+    w.finish();
+    return w;
+}
+#endif // BENCH_WORKLOADS
+
+////////////////////////////////////////////////////////////////
+// Measurement
+////////////////////////////////////////////////////////////////
+
+#define RUNS 7 // report the best of this many runs
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// cost of reading the clock (subtracted from each stage)
+static uint64_t clock_overhead() {
+    uint64_t best = ~(uint64_t)0;
+    for(int i = 0; i < 1000; ++i) {
+        uint64_t t0 = now_ns();
+        uint64_t t1 = now_ns();
+        if (t1 - t0 < best) {
+            best = t1 - t0;
+        }
+    }
+    return best;
+}
+
+#if BENCH_WORKLOADS
+#define STAGES 4
+
+static const char *stage_names[STAGES] = {
+    "scan_keyboard", "decode", "send_keys", "pointer",
+};
+
+static void run(const workload &w, uint64_t overhead) {
+    double best[STAGES];
+    unsigned long reports = 0;
+    for(int s = 0; s < STAGES; ++s) {
+        best[s] = 1e30;
+    }
+    for(int r = 0; r < RUNS; ++r) {
+        uint64_t total[STAGES] = { 0 };
+        keyboard_reports = 0;
+        for(size_t i = 0; i < w.scans.size(); ++i) {
+            load_frame(w.scans[i]);
+            uint64_t t0 = now_ns();
+            scan_keyboard();
+            uint64_t t1 = now_ns();
+            decode();
+            uint64_t t2 = now_ns();
+            send_keys();
+            uint64_t t3 = now_ns();
+#if HAVE_POINTER
+            for(int j = 0; j < 10 / POINTER_INTERVAL; ++j) {
+                update_pointer();
+            }
+#endif
+            uint64_t t4 = now_ns();
+            sim_time += 10;
+            total[0] += t1 - t0;
+            total[1] += t2 - t1;
+            total[2] += t3 - t2;
+            total[3] += t4 - t3;
+        }
+        for(int s = 0; s < STAGES; ++s) {
+            uint64_t t = total[s] > overhead * w.scans.size() ? total[s] - overhead * w.scans.size() : 0;
+            double per_scan = (double)t / w.scans.size();
+            if (per_scan < best[s]) {
+                best[s] = per_scan;
+            }
+        }
+        reports = keyboard_reports;
+    }
+    printf("# %s: %u scans, %lu keyboard reports\n", w.name, (unsigned)w.scans.size(), reports);
+    for(int s = 0; s < STAGES; ++s) {
+        printf("%s.%s.%-16s %8.1f\n", BENCH_NAME, w.name, stage_names[s], best[s]);
+    }
+}
+#endif // BENCH_WORKLOADS
+
+#if HAVE_LEADER && !BENCH_MATRIX
+////////////////////////////////////////////////////////////////
+// Leader sequences
+////////////////////////////////////////////////////////////////
+
+// random walks through the leader DFA (some stop at a prefix)
+static std::vector<uint8_t> leader_walks(int count, int *keys) {
+    uint8_t key_of[256] = { 0 }; // a key for each input class
+    int classes = 0;
+    for(int key = 127; key > 0; --key) {
+        key_of[leader_class[key]] = key;
+        classes = leader_class[key] > classes ? leader_class[key] : classes;
+    }
+    std::vector<uint8_t> walks; // keys of each walk then 0
+    srand(1);
+    *keys = 0;
+    for(int i = 0; i < count; ++i) {
+        uint16_t state = 0;
+        do {
+            uint8_t next[256];
+            int n = 0;
+            for(int c = 1; c <= classes; ++c) {
+                uint16_t t = leader_dfa[state].base + c;
+                if (leader_dfa[t].check == state) {
+                    next[n++] = c;
+                }
+            }
+            uint8_t c = next[rand() % n];
+            state = leader_dfa[state].base + c;
+            walks.push_back(key_of[c]);
+            ++*keys;
+        } while (leader_dfa[state].base != 0 && !(leader_dfa[state].keycode && rand() % 4 == 0));
+        walks.push_back(0);
+    }
+    return walks;
+}
+
+// cost of each key typed after LEADER, including producing the keycode
+static void run_leader(uint64_t overhead) {
+    int keys;
+    std::vector<uint8_t> walks = leader_walks(1000, &keys);
+    double best = 1e30;
+    for(int r = 0; r < RUNS; ++r) {
+        uint64_t t0 = now_ns();
+        start_leader();
+        for(size_t i = 0; i < walks.size(); ++i) {
+            if (walks[i]) {
+                advance_leader(walks[i]);
+            } else {
+                if (leader_state != LEADER_IDLE) {
+                    finish_leader();
+                }
+                start_leader();
+            }
+        }
+        uint64_t t = now_ns() - t0;
+        t = t > overhead ? t - overhead : 0;
+        if ((double)t / keys < best) {
+            best = (double)t / keys;
+        }
+    }
+    printf("# leader: %d keys in 1000 sequences (%d slots)\n", keys, (int)(sizeof(leader_dfa) / sizeof(leader_dfa[0])));
+    printf("%s.leader.%-16s %8.1f\n", BENCH_NAME, "advance_leader", best);
+}
+#endif
+
+#if HAVE_EXPANSION && !BENCH_MATRIX
+////////////////////////////////////////////////////////////////
+// Text expansion
+////////////////////////////////////////////////////////////////
+
+// random text: a few keys then an abbreviation, count times
+// (abbreviations are random walks through the reversed DFA)
+static std::vector<uint8_t> abbrev_text(int count) {
+    uint8_t key_of[256] = { 0 }; // a key (and shift bit) for each input class
+    int classes = 0;
+    for(int key = 255; key > 0; --key) {
+        key_of[abbrev_class[key]] = key;
+        classes = abbrev_class[key] > classes ? abbrev_class[key] : classes;
+    }
+    std::vector<uint8_t> text;
+    srand(1);
+    for(int i = 0; i < count; ++i) {
+        for(int n = rand() % 4; n > 0; --n) {
+            text.push_back(key_of[1 + rand() % classes]);
+        }
+        std::vector<uint8_t> abbrev;
+        uint16_t state = 0;
+        do {
+            uint8_t next[256];
+            int n = 0;
+            for(int c = 1; c <= classes; ++c) {
+                uint16_t t = abbrev_dfa[state].base + c;
+                if (abbrev_dfa[t].check == state) {
+                    next[n++] = c;
+                }
+            }
+            uint8_t c = next[rand() % n];
+            state = abbrev_dfa[state].base + c;
+            abbrev.insert(abbrev.begin(), key_of[c]);
+        } while (!abbrev_dfa[state].keycode || (abbrev_dfa[state].base != 0 && rand() % 2));
+        text.insert(text.end(), abbrev.begin(), abbrev.end());
+    }
+    return text;
+}
+
+// cost of each key typed, including any expansions (as in decode)
+static void run_abbrev(uint64_t overhead) {
+    std::vector<uint8_t> text = abbrev_text(1000);
+    double best = 1e30;
+    for(int r = 0; r < RUNS; ++r) {
+        forget_typed();
+        uint64_t t0 = now_ns();
+        for(size_t i = 0; i < text.size(); ++i) {
+            uint16_t keycode = 0x4000 | (text[i] & 0x7f);
+            keyboard_modifier_keys = (text[i] & 0x80) ? (1 << LEFT_SHIFT) : 0;
+            resolve_typed(keycode);
+            expand_typed(typed_key(keycode));
+        }
+        uint64_t t = now_ns() - t0;
+        t = t > overhead ? t - overhead : 0;
+        if ((double)t / text.size() < best) {
+            best = (double)t / text.size();
+        }
+    }
+    printf("# abbrev: %u keys with 1000 abbreviations (%d slots)\n",
+           (unsigned)text.size(), (int)(sizeof(abbrev_dfa) / sizeof(abbrev_dfa[0])));
+    printf("%s.abbrev.%-16s %8.1f\n", BENCH_NAME, "expand_typed", best);
+}
+#endif
+
+#if BENCH_MATRIX
+////////////////////////////////////////////////////////////////
+// Matrix sizes
+////////////////////////////////////////////////////////////////
+
+static_assert(NUMKEYS >= 256, "BENCH_MATRIX needs NUMKEYS 256");
+
+// A matrix without pins (ID makes each one separate)
+template <int ID, uint8_t ROWS, uint8_t COLS>
+struct bench_matrix {
+    static const uint8_t NUM_ROWS = ROWS;
+    static const uint8_t NUM_COLS = COLS;
+    static uint32_t pressed[ROWS];
+
+    static void init() {}
+    static uint32_t read_row(uint8_t row) {
+        return pressed[row];
+    }
+    static void set_key(int key, boolean down) {
+        uint32_t bit = 1u << (key % COLS);
+        pressed[key / COLS] = down ? (pressed[key / COLS] | bit) : (pressed[key / COLS] & ~bit);
+    }
+};
+template <int ID, uint8_t ROWS, uint8_t COLS>
+uint32_t bench_matrix<ID, ROWS, COLS>::pressed[ROWS];
+
+// 72 keys (the keyboard), 128 keys and 256 keys (the keyboard and a
+// second matrix numbered from the end of it)
+typedef bench_matrix<0, 6, 12> matrix72;
+typedef bench_matrix<1, 8, 16> matrix128;
+typedef bench_matrix<2, 6, 12> matrix256a;
+typedef bench_matrix<3, 8, 23> matrix256b;
+static matrix_scanner<matrix72> scanner72;
+static matrix_scanner<matrix128> scanner128;
+static matrix_scanner<matrix256a> scanner256a;
+static matrix_scanner<matrix256b, 72> scanner256b;
+
+static void set72(int key, boolean down)  { matrix72::set_key(key, down); }
+static void set128(int key, boolean down) { matrix128::set_key(key, down); }
+static void set256(int key, boolean down) {
+    if (key < 72) {
+        matrix256a::set_key(key, down);
+    } else {
+        matrix256b::set_key(key - 72, down);
+    }
+}
+static void scan72()  { scanner72.scan(); }
+static void scan128() { scanner128.scan(); }
+static void scan256() { scanner256a.scan(); scanner256b.scan(); }
+
+struct matrix_config {
+    const char *name;
+    int keys;
+    void (*set_key)(int key, boolean down);
+    void (*scan)();
+};
+
+static const matrix_config matrix_configs[] = {
+    { "keys72",  72,  set72,  scan72 },
+    { "keys128", 128, set128, scan128 },
+    { "keys256", 256, set256, scan256 },
+};
+
+// scan and decode cost when changed keys (spread over the matrix) are
+// pressed and released on alternate scans.  Keys are letters and the
+// like, or have no keycode (as in a matrix without a keymap), so that
+// the cost is that of finding the keys rather than of what they do.
+static std::vector<int> plain_keys(const matrix_config &m) {
+    std::vector<int> keys;
+    for(int key = 0; key < m.keys; ++key) {
+        uint16_t keycode = layers[0][key];
+        if (!keycode || (IS_NORMAL(keycode) && !IS_MODKEY(keycode))) {
+            keys.push_back(key);
+        }
+    }
+    return keys;
+}
+
+static void run_matrix(const matrix_config &m, int changed, uint64_t overhead) {
+    const int scans = 1000;
+    std::vector<int> plain = plain_keys(m);
+    if (changed > (int)plain.size()) {
+        return;
+    }
+    int keys[64];
+    for(int k = 0; k < changed; ++k) {
+        keys[k] = plain[k * plain.size() / changed];
+    }
+    double best[2] = { 1e30, 1e30 };
+    for(int r = 0; r < RUNS; ++r) {
+        uint64_t total[2] = { 0, 0 };
+        for(int i = 0; i < scans; ++i) {
+            for(int k = 0; k < changed; ++k) {
+                m.set_key(keys[k], i % 2 == 0);
+            }
+            raw_count = 0;
+            uint64_t t0 = now_ns();
+            m.scan();
+            uint64_t t1 = now_ns();
+            decode();
+            uint64_t t2 = now_ns();
+            send_keys();
+            total[0] += t1 - t0;
+            total[1] += t2 - t1;
+        }
+        for(int s = 0; s < 2; ++s) {
+            uint64_t t = total[s] > overhead * scans ? total[s] - overhead * scans : 0;
+            if ((double)t / scans < best[s]) {
+                best[s] = (double)t / scans;
+            }
+        }
+    }
+    printf("%s.%s.changed%d.%-8s %8.1f\n", BENCH_NAME, m.name, changed, "scan", best[0]);
+    printf("%s.%s.changed%d.%-8s %8.1f\n", BENCH_NAME, m.name, changed, "decode", best[1]);
+}
+
+static void run_matrices(uint64_t overhead) {
+    const int changed[] = { 1, 4, 16, 64 };
+    for(unsigned i = 0; i < sizeof(matrix_configs) / sizeof(matrix_configs[0]); ++i) {
+        printf("# %s: %d keys (%d plain)\n", matrix_configs[i].name, matrix_configs[i].keys,
+               (int)plain_keys(matrix_configs[i]).size());
+        for(unsigned j = 0; j < sizeof(changed) / sizeof(changed[0]); ++j) {
+            run_matrix(matrix_configs[i], changed[j], overhead);
+        }
+    }
+}
+#endif // BENCH_MATRIX
+
+static void print_size(const char *name, size_t size) {
+    printf("%s.table.%-16s %6u\n", BENCH_NAME, name, (unsigned)size);
+}
+
+int main() {
+    setup();
+
+    printf("# table sizes (bytes)\n");
+    print_size("layers", sizeof(layers));
+#if HAVE_LEADER
+    print_size("leader", sizeof(leader_class) + sizeof(leader_dfa));
+#endif
+#if HAVE_EXPANSION
+    print_size("abbrev", sizeof(abbrev_class) + sizeof(abbrev_dfa) + sizeof(abbrev_fwd));
+#endif
+    print_size("strings", sizeof(string_pool) + sizeof(string_table));
+    printf("# strings: %u bytes if each key had its own string and length\n",
+           (unsigned)STRING_PER_KEY_BYTES);
+    printf("%s.strings.%-14s %6.1f\n", BENCH_NAME, "per_key",
+           100.0 * (sizeof(string_pool) + sizeof(string_table)) / STRING_PER_KEY_BYTES);
+
+    uint64_t overhead = clock_overhead();
+    printf("# host nanoseconds per scan (best of %d runs, clock overhead %u ns removed)\n",
+           RUNS, (unsigned)overhead);
+#if BENCH_WORKLOADS
+    run(idle_workload(), overhead);
+    run(typing_workload(), overhead);
+    run(rollover_workload(), overhead);
+    run(unicode_workload(), overhead);
+    run(tapper_workload(), overhead);
+#endif
+#if BENCH_MATRIX
+    run_matrices(overhead);
+#else
+#if HAVE_LEADER
+    run_leader(overhead);
+#endif
+#if HAVE_EXPANSION
+    run_abbrev(overhead);
+#endif
+#endif
+    return 0;
+}
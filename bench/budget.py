@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+#
+# Check benchmark results and firmware sizes against budgets.
+#
+# Usage: budget.py BUDGET [RESULTS ...]
+#                  [--elf FILE [--prefix PREFIX] [--size SIZE] [--nm NM]]
+#
+# BUDGET and RESULTS are lists of "name value" lines (lines starting with
+# '#' are ignored).  RESULTS is normally the output of bench (see
+# bench.cpp).  With --elf, the firmware (or an object file) is also
+# measured with size and nm, and PREFIX is put in front of the names:
+#
+#     code            bytes in the code and constant sections (.text, .rodata)
+#     ram             bytes in the RAM sections (.data, .bss and USB buffers)
+#     symbol.NAME     bytes used by a symbol (eg symbol.layers)
+#
+# Every budgeted measurement is printed with its limit.  The exit status
+# is 1 if anything is over budget, if a budget has no measurement or if
+# a result has no budget.
+
+import re
+import subprocess
+import sys
+
+CODE_SECTIONS = (".text", ".rodata")
+RAM_SECTIONS = (".data", ".bss", ".usbdescriptortable", ".dmabuffers", ".usbbuffers")
+
+def read_values(path):
+    values = {}
+    with open(path) as f:
+        for lineno, line in enumerate(f, 1):
+            line = line.strip()
+            if not line or line.startswith("#"):
+                continue
+            fields = line.split()
+            if len(fields) != 2:
+                sys.exit("budget: %s:%d: expected name and value" % (path, lineno))
+            try:
+                values[fields[0]] = float(fields[1])
+            except ValueError:
+                sys.exit("budget: %s:%d: bad value %r" % (path, lineno, fields[1]))
+    return values
+
+def run(args):
+    try:
+        return subprocess.check_output(args, universal_newlines=True)
+    except (OSError, subprocess.CalledProcessError) as e:
+        sys.exit("budget: %s: %s" % (args[0], e))
+
+# total size of the sections named in kinds (object files split them,
+# eg .text.NAME for template functions)
+def section_size(sections, kinds):
+    return sum(size for name, size in sections.items()
+               if any(name == k or name.startswith(k + ".") for k in kinds))
+
+def measure_elf(elf, prefix, size, nm):
+    values = {}
+    sections = {}
+    for line in run([size, "-A", elf]).splitlines():
+        fields = line.split()
+        if len(fields) == 3 and fields[0].startswith(".") and fields[1].isdigit():
+            sections[fields[0]] = int(fields[1])
+    values[prefix + "code"] = section_size(sections, CODE_SECTIONS)
+    values[prefix + "ram"] = section_size(sections, RAM_SECTIONS)
+    # address, size, type and name (symbols without a size are skipped)
+    for line in run([nm, "-S", "-C", elf]).splitlines():
+        m = re.match(r"[0-9a-fA-F]+ ([0-9a-fA-F]+) \w (.+)$", line)
+        if m:
+            name = prefix + "symbol." + m.group(2)
+            values[name] = max(values.get(name, 0), int(m.group(1), 16))
+    return values
+
+def main():
+    args = sys.argv[1:]
+    options = {"--elf": None, "--prefix": "", "--size": "size", "--nm": "nm"}
+    for opt in list(options):
+        if opt in args:
+            i = args.index(opt)
+            if i + 1 >= len(args):
+                sys.exit("budget: %s needs an argument" % opt)
+            options[opt] = args[i + 1]
+            del args[i:i + 2]
+    if not args:
+        sys.exit("usage: budget.py BUDGET [RESULTS ...] "
+                 "[--elf FILE [--prefix PREFIX] [--size SIZE] [--nm NM]]")
+
+    budget = read_values(args[0])
+    results = {}
+    for path in args[1:]:
+        results.update(read_values(path))
+    values = dict(results)
+    if options["--elf"]:
+        values.update(measure_elf(options["--elf"], options["--prefix"],
+                                  options["--size"], options["--nm"]))
+
+    over = 0
+    failed = 0
+    for name in sorted(budget):
+        limit = budget[name]
+        if name not in values:
+            print("%-32s %10s %10g  NOT MEASURED" % (name, "-", limit))
+            failed += 1
+            continue
+        value = values[name]
+        status = "ok"
+        if value > limit:
+            status = "OVER BUDGET"
+            over += 1
+        print("%-32s %10g %10g  %3.0f%%  %s" % (name, value, limit, 100.0 * value / limit, status))
+    # every benchmark result needs a budget (symbols only do if asked for)
+    for name in sorted(results):
+        if name not in budget:
+            print("%-32s %10g %10s  NO BUDGET" % (name, results[name], "-"))
+            failed += 1
+    if over:
+        sys.exit("budget: %d measurement%s over budget" % (over, "" if over == 1 else "s"))
+    if failed:
+        sys.exit("budget: %d missing measurement%s or budget%s"
+                 % (failed, "" if failed == 1 else "s", "" if failed == 1 else "s"))
+
+if __name__ == "__main__":
+    main()
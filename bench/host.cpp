@@ -0,0 +1,115 @@
+// Simulated Teensy for the host builds of the firmware (see Arduino.h).
+// Programs include this once, before main.cpp.
+//
+// The key matrix is simulated at the pin level: sim_pins[row pin] has
+// a bit set for each column pin connected to it by a pressed key.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Arduino.h"
+#include "usb_keyboard.h"
+
+#define SIM_PINS 64
+
+static uint64_t sim_pins[SIM_PINS];
+static int      sim_driven = -1; // row pin driven low
+static uint32_t sim_time;        // ms
+
+// analog readings (a joystick at rest unless a program sets this)
+static int (*sim_analog)(uint8_t pin);
+
+void pinMode(uint8_t, uint8_t) {}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+    if (value == LOW) {
+        sim_driven = pin;
+    } else if (sim_driven == pin) {
+        sim_driven = -1;
+    }
+}
+
+uint8_t digitalRead(uint8_t pin) {
+    if (sim_driven < 0 || sim_driven >= SIM_PINS || pin >= SIM_PINS) {
+        return HIGH;
+    }
+    return (sim_pins[sim_driven] >> pin) & 1 ? LOW : HIGH;
+}
+
+int analogRead(uint8_t pin) {
+    return sim_analog ? sim_analog(pin) : 512;
+}
+
+void delay(uint32_t ms) { sim_time += ms; }
+void delayMicroseconds(uint32_t) {}
+uint32_t millis() { return sim_time; }
+uint32_t micros() { return sim_time * 1000; }
+
+int Stream::available() {
+    return rx_len - rx_pos;
+}
+
+int Stream::read() {
+    if (rx_pos == rx_len) {
+        return -1;
+    }
+    return rx[rx_pos++];
+}
+
+size_t Stream::write(uint8_t b) {
+    return write(&b, 1);
+}
+
+size_t Stream::write(const uint8_t *buf, size_t len) {
+    for(size_t i = 0; i < len && tx_len < sizeof(tx); ++i) {
+        tx[tx_len++] = buf[i];
+    }
+    return len;
+}
+
+void Stream::begin(long) {}
+
+Stream Serial, Serial1;
+
+// add bytes for the firmware to read from a stream
+static inline void sim_receive(Stream *s, const uint8_t *buf, unsigned len) {
+    if (s->rx_pos == s->rx_len) {
+        s->rx_pos = s->rx_len = 0;
+    }
+    for(unsigned i = 0; i < len && s->rx_len < sizeof(s->rx); ++i) {
+        s->rx[s->rx_len++] = buf[i];
+    }
+}
+
+static unsigned long mouse_reports;
+static long mouse_x, mouse_y; // total pointer motion
+void usb_mouse_class::move(int8_t x, int8_t y, int8_t) {
+    ++mouse_reports;
+    mouse_x += x;
+    mouse_y += y;
+}
+void usb_mouse_class::set_buttons(uint8_t, uint8_t, uint8_t) { ++mouse_reports; }
+usb_mouse_class Mouse;
+
+uint8_t keyboard_modifier_keys;
+uint8_t keyboard_keys[6];
+uint8_t keyboard_media_keys;
+
+static unsigned long keyboard_reports;
+static void (*sim_report)(); // called with each keyboard report
+
+int usb_keyboard_send() {
+    ++keyboard_reports;
+    if (sim_report) {
+        sim_report();
+    }
+    return 0;
+}
+
+// report a failed check and exit (for host tests)
+#define CHECK(x) do { \
+    if (!(x)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+        exit(1); \
+    } \
+} while (0)
@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+#
+# Generate a large list of key sequences for benchmarking mkdfa.py tables
+# (or of strings for mkstrings.py).
+#
+# Usage: mkwords.py leader|abbrev|strings COUNT > NAME.txt
+#
+# The output is in the format read by mkdfa.py (or mkstrings.py).
+# Sequences are random but the same on every run, so benchmark results
+# can be compared.
+#
+#     leader   COUNT sequences of 2 to 6 letters (some of them are the
+#              start of longer ones, as in leader.txt)
+#     abbrev   COUNT abbreviations, most like "\name " and the rest
+#              2 to 4 punctuation characters like "<->" (some of them are
+#              the start of longer ones, as in abbrev.txt)
+#     strings  COUNT emoji strings: people with each skin tone and
+#              gender, as in unicode.txt (shorter ones are often the
+#              start of longer ones)
+
+import random
+import sys
+
+LETTERS = "abcdefghijklmnopqrstuvwxyz"
+PUNCTUATION = "<>-=|/[]"
+KEYCODES = ["KEY_" + ch.upper() for ch in LETTERS]
+
+def leader_words(rng, count):
+    words = set()
+    while len(words) < count:
+        words.add("".join(rng.choice(LETTERS) for _ in range(rng.randint(2, 6))))
+    return sorted(words)
+
+def abbrev_words(rng, count):
+    words = set()
+    while len(words) < count:
+        if rng.random() < 0.9:
+            name = "".join(rng.choice(LETTERS) for _ in range(rng.randint(2, 7)))
+            words.add("\\" + name + " ")
+        else:
+            words.add("".join(rng.choice(PUNCTUATION) for _ in range(rng.randint(2, 4))))
+    return sorted(words)
+
+SKIN_TONES = ["U+1F3FB", "U+1F3FC", "U+1F3FD", "U+1F3FE", "U+1F3FF"]
+GENDERS = ["U+200D U+2640 U+FE0F", "U+200D U+2642 U+FE0F"]
+
+def emoji_strings(rng, count):
+    strings = []
+    bases = list(range(0x1f466, 0x1f4ff))
+    rng.shuffle(bases)
+    for base in bases:
+        person = "U+%X" % base
+        family = [person]
+        family += [person + " " + tone for tone in SKIN_TONES]
+        family += [person + " " + gender for gender in GENDERS]
+        family += [person + " " + tone + " " + gender
+                   for tone in SKIN_TONES for gender in GENDERS]
+        strings += family
+        if len(strings) >= count:
+            break
+    return strings[:count]
+
+def main():
+    kinds = {"leader": leader_words, "abbrev": abbrev_words, "strings": emoji_strings}
+    if len(sys.argv) != 3 or sys.argv[1] not in kinds:
+        sys.exit("usage: mkwords.py leader|abbrev|strings COUNT")
+    count = int(sys.argv[2])
+    rng = random.Random(1)
+    words = kinds[sys.argv[1]](rng, count)
+    print("# Generated by mkwords.py - do not edit")
+    if sys.argv[1] == "strings":
+        for i, string in enumerate(words):
+            print("GEN_%d %s" % (i, string))
+        return
+    for i, word in enumerate(words):
+        print('"%s" %s' % (word, KEYCODES[i % len(KEYCODES)]))
+
+if __name__ == "__main__":
+    main()
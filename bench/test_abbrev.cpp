@@ -0,0 +1,161 @@
+// Host test of text expansion (see abbrev.txt).
+//
+// Keys are typed into the simulated matrix and the keyboard reports
+// are turned back into the text the host would see, with the Unicode
+// input sequences (see send_unicode_string) decoded to codepoints and
+// the left and right arrows moving the text cursor.
+
+#include <vector>
+
+#include "host.cpp"
+#include "main.cpp"
+
+#define SHIFTED 0x80 // text entry for a key typed with shift
+
+static std::vector<uint32_t> text; // keys (with SHIFTED) and codepoints
+static size_t   cursor;
+static uint8_t  last_key;
+static boolean  in_unicode;
+static uint32_t code;
+
+// what the host makes of each report
+static void host_report() {
+    uint8_t key = keyboard_keys[0];
+    if (key == last_key) {
+        return;
+    }
+    last_key = key;
+    if (key == 0) {
+        return;
+    }
+    if (key == (KEYPAD_2 & 0xff)) {
+        in_unicode = true;
+        code = 0;
+    } else if (key == (KEYPAD_1 & 0xff)) {
+        in_unicode = false;
+        text.insert(text.begin() + cursor++, code);
+    } else if (in_unicode) {
+        for(int i = 0; i < 16; ++i) {
+            if (key == (hex_to_raw[i] & 0xff)) {
+                code = (code << 4) | i;
+            }
+        }
+    } else if (key == (KEY_BACKSPACE & 0xff)) {
+        if (cursor) {
+            text.erase(text.begin() + --cursor);
+        }
+    } else if (key == (KEY_LEFT & 0xff)) {
+        if (cursor) {
+            --cursor;
+        }
+    } else if (key == (KEY_RIGHT & 0xff)) {
+        if (cursor < text.size()) {
+            ++cursor;
+        }
+    } else {
+        boolean shift = keyboard_modifier_keys & ((1 << LEFT_SHIFT) | (1 << RIGHT_SHIFT));
+        text.insert(text.begin() + cursor++, key | (shift ? SHIFTED : 0));
+    }
+}
+
+static void set_key(uint16_t keycode, boolean down) {
+    for(int raw = 0; raw < MATRIX_KEYS; ++raw) {
+        if (layers[0][raw] == keycode) {
+            uint8_t  row = keyboard_pins::rows[raw / MATRIX_COLS];
+            uint64_t col = (uint64_t)1 << keyboard_pins::cols[raw % MATRIX_COLS];
+            sim_pins[row] = down ? (sim_pins[row] | col) : (sim_pins[row] & ~col);
+            return;
+        }
+    }
+    CHECK(!"keycode not on layer 0");
+}
+
+static void scan(int n = DEBOUNCE_TIMEOUT + 2) {
+    while (n-- > 0) {
+        loop();
+    }
+}
+
+static void tap(uint16_t keycode, boolean shift = false) {
+    if (shift) {
+        set_key(LSHIFT, true);
+        scan();
+    }
+    set_key(keycode, true);
+    scan();
+    set_key(keycode, false);
+    scan();
+    if (shift) {
+        set_key(LSHIFT, false);
+        scan();
+    }
+}
+
+// Dvorak "<", "-" and ">" are Qwerty shift-W, ' and shift-E
+static void less()    { tap(KEY_W, true); }
+static void minus()   { tap(KEY_QUOTE); }
+static void greater() { tap(KEY_E, true); }
+
+static void check_text(const std::vector<uint32_t> &expected, int line) {
+    if (text != expected) {
+        fprintf(stderr, "test_abbrev.cpp:%d: got", line);
+        for(size_t i = 0; i < text.size(); ++i) {
+            fprintf(stderr, " %x", (unsigned)text[i]);
+        }
+        fprintf(stderr, "\n");
+        exit(1);
+    }
+    text.clear();
+    cursor = 0;
+    forget_typed();
+}
+#define CHECK_TEXT(...) check_text(std::vector<uint32_t>{ __VA_ARGS__ }, __LINE__)
+
+int main() {
+    setup();
+    sim_report = host_report;
+
+    minus(); greater();         // "->"
+    CHECK_TEXT(0x2192);
+
+    less(); minus(); greater(); // "<->" is not cut short by "<-"
+    CHECK_TEXT(0x2194);
+
+    less(); minus();            // "<-" is expanded before the next key
+    tap(KEY_X);
+    CHECK_TEXT(0x2190, KEY_X & 0x7f);
+
+    less(); minus();            // with the modifiers of the next key
+    tap(KEY_A, true);
+    CHECK_TEXT(0x2190, (KEY_A & 0x7f) | SHIFTED);
+
+    less(); minus();            // or when nothing follows
+    scan(EXPANSION_TIMEOUT);
+    CHECK_TEXT(0x2190);
+
+    less(); minus();            // a backspace cancels it
+    tap(KEY_BACKSPACE);
+    CHECK_TEXT((KEY_W & 0x7f) | SHIFTED);
+
+    less(); minus();            // and deletes one key
+    tap(KEY_BACKSPACE);
+    minus(); greater();
+    CHECK_TEXT(0x2194);
+
+    less(); minus();            // a key that resolve_typed did not see
+    press_key(0, KEY_X & 0x7f); // (eg the modifiers changed in between)
+    send_keys();
+    expand_typed(KEY_X & 0x7f);
+    clear_keys();
+    send_keys();
+    CHECK_TEXT(0x2190, KEY_X & 0x7f);
+
+    tap(KEY_A); minus();        // a cursor key is not text
+    tap(KEY_LEFT);
+    tap(KEY_BACKSPACE);
+    greater();
+    CHECK_TEXT((KEY_E & 0x7f) | SHIFTED, KEY_QUOTE & 0x7f);
+
+    printf("test_abbrev: ok\n");
+    return 0;
+}
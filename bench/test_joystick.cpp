@@ -0,0 +1,139 @@
+// Host test of the analog joystick (see the pointer section of main.cpp).
+//
+// The deadzone, filter, rounding and speed curve are checked over
+// their whole range, then traces of joystick readings are played
+// through update_pointer and the pointer motion is checked.
+
+#define HAVE_JOYSTICK 1
+
+#include "host.cpp"
+#include "main.cpp"
+
+#define CENTRE 530 // not 512, so that the calibration matters
+
+static int stick_x = CENTRE;
+static int stick_y = CENTRE;
+static int noise;   // added to readings, alternating in sign
+
+static int read_stick(uint8_t pin) {
+    noise = -noise;
+    return (pin == JOYSTICK_X_PIN ? stick_x : stick_y) + noise;
+}
+
+static void check_deadzone() {
+    for(int x = -JOYSTICK_DEADZONE; x <= JOYSTICK_DEADZONE; ++x) {
+        CHECK(joystick_deadzone(x) == 0);
+    }
+    for(int x = -512; x < 512; ++x) {
+        CHECK(joystick_deadzone(-x) == -joystick_deadzone(x));
+        int step = joystick_deadzone(x + 1) - joystick_deadzone(x);
+        CHECK(step >= 0 && step <= 2); // no jump at the edge
+    }
+    CHECK(joystick_deadzone(JOYSTICK_FULL - 1) < 512);
+    CHECK(joystick_deadzone(JOYSTICK_FULL) == 512);
+    CHECK(joystick_deadzone(1023) == 512);
+}
+
+static void check_round() {
+    for(int32_t s = -512 * 256; s <= 512 * 256; ++s) {
+        CHECK(joystick_round(-s) == -joystick_round(s));
+        int16_t x = joystick_round(s);
+        CHECK(labs(s - x * 256) <= 128);
+    }
+}
+
+static void check_speed() {
+    CHECK(joystick_speed(0) == 0);
+    CHECK(joystick_speed(512) == joystick_curve[8]);
+    for(int x = -512; x < 512; ++x) {
+        CHECK(joystick_speed(-x) == -joystick_speed(x));
+        int step = joystick_speed(x + 1) - joystick_speed(x);
+        CHECK(step >= 0 && step <= 2); // increasing without jumps
+    }
+}
+
+static void check_filter() {
+    // a step converges without overshoot, then decays back to zero
+    int32_t smooth = 0;
+    for(int i = 0; i < 100; ++i) {
+        int32_t next = joystick_filter(smooth, 400);
+        CHECK(next >= smooth && next <= 400 * 256);
+        smooth = next;
+    }
+    CHECK(joystick_round(smooth) == 400);
+    for(int i = 0; i < 100; ++i) {
+        int32_t next = joystick_filter(smooth, 0);
+        CHECK(next <= smooth && next >= 0);
+        smooth = next;
+    }
+    CHECK(smooth == 0);
+    for(int i = 0; i < 100; ++i) {
+        smooth = joystick_filter(smooth, -400);
+    }
+    CHECK(joystick_round(smooth) == -400);
+}
+
+// play reports and return the pointer motion
+static void play(int reports, long *x, long *y) {
+    mouse_x = mouse_y = 0;
+    for(int i = 0; i < reports; ++i) {
+        update_pointer();
+    }
+    *x = mouse_x;
+    *y = mouse_y;
+}
+
+static void check_traces() {
+    long x, y;
+
+    // at rest, with noise inside the deadzone: no motion
+    noise = JOYSTICK_DEADZONE / 2;
+    play(1000, &x, &y);
+    CHECK(x == 0 && y == 0);
+
+    // pushed right: speeds up to the top of the curve and stays there
+    // (the stick only goes 1023 - CENTRE from the centre)
+    long full = 1000 * joystick_curve[8] / 256;
+    stick_x = 1023;
+    play(1000, &x, &y);
+    long right = x;
+    CHECK(y == 0);
+    CHECK(right > full * 9 / 10 && right < full);
+    play(1000, &x, &y);
+    CHECK(x == full && y == 0);
+
+    // released: stops within a few filter time constants
+    stick_x = CENTRE;
+    play(64, &x, &y);
+    play(1000, &x, &y);
+    CHECK(x == 0 && y == 0);
+
+    // pushed left (as far from the centre): the same speed
+    stick_x = 2 * CENTRE - 1023;
+    play(1000, &x, &y);
+    CHECK(x == -right && y == 0);
+    play(1000, &x, &y);
+    CHECK(x == -full && y == 0);
+    stick_x = CENTRE;
+    play(64, &x, &y);
+
+    // half way up: slower than full
+    stick_y = CENTRE - 256;
+    play(1000, &x, &y);
+    CHECK(x == 0 && y < 0 && -y < right / 2);
+}
+
+int main() {
+    sim_analog = read_stick;
+    setup();
+    CHECK(joystick[0].centre == CENTRE && joystick[1].centre == CENTRE);
+
+    check_deadzone();
+    check_round();
+    check_speed();
+    check_filter();
+    check_traces();
+
+    printf("test_joystick: ok\n");
+    return 0;
+}
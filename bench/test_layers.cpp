@@ -0,0 +1,125 @@
+// Host test of the layer state (MO, TG, OSL and DF keys).
+//
+// No layer in the keymap uses these keys yet, so the layer keys are
+// fed to press_layer and release_layer directly, in the order decode()
+// handles them, and other keys are looked up with find_key.
+
+#include "host.cpp"
+#include "main.cpp"
+
+static rawkey_t key_u; // KEY_U on layer 0, something else on the others
+static rawkey_t key_1; // KEY_1 on layer 0, nothing on layers 2-5
+
+static rawkey_t find_raw(uint16_t keycode) {
+    for(int raw = 0; raw < NUMKEYS; ++raw) {
+        if (layers[0][raw] == keycode) {
+            return raw;
+        }
+    }
+    CHECK(!"keycode not on layer 0");
+    return 0;
+}
+
+// a layer key pressed and released (decode() pass 1)
+static void layer_down(uint16_t keycode) { press_layer(keycode); }
+static void layer_up(uint16_t keycode)   { release_layer(keycode); }
+static void layer_tap(uint16_t keycode) {
+    layer_down(keycode);
+    layer_up(keycode);
+}
+
+// the keycode of another key pressed (decode() pass 2)
+static uint16_t key(rawkey_t raw) {
+    uint16_t keycode = find_key(raw);
+    resolve_oneshot_layers();
+    return keycode;
+}
+
+static void check_momentary() {
+    layer_down(MO(3));
+    CHECK(key(key_u) == MOUSE(BTN1));
+    CHECK(key(key_1) == KEY_1); // nothing on layer 3
+    CHECK(key(key_u) == MOUSE(BTN1));
+    layer_up(MO(3));
+    CHECK(key(key_u) == KEY_U);
+}
+
+static void check_toggle() {
+    layer_tap(TG(1));
+    CHECK(key(key_u) == KEY_7);
+    CHECK(key(key_1) == KEY_F1);
+    layer_tap(TG(1));
+    CHECK(key(key_u) == KEY_U);
+}
+
+static void check_oneshot() {
+    // tapped: the next key only
+    layer_tap(OSL(4));
+    CHECK(key(key_u) == STR_BB_N);
+    CHECK(key(key_u) == KEY_U);
+
+    // held: every key until released
+    layer_down(OSL(4));
+    CHECK(key(key_u) == STR_BB_N);
+    CHECK(key(key_u) == STR_BB_N);
+    layer_up(OSL(4));
+    CHECK(key(key_u) == KEY_U);
+
+    // tapped again after being held
+    layer_tap(OSL(4));
+    CHECK(key(key_u) == STR_BB_N);
+    CHECK(key(key_u) == KEY_U);
+}
+
+static void check_default() {
+    layer_tap(DF(1));
+    CHECK(key(key_u) == KEY_7);
+    layer_down(MO(3)); // above the default layer
+    CHECK(key(key_u) == MOUSE(BTN1));
+    layer_up(MO(3));
+    CHECK(key(key_u) == KEY_7);
+    layer_tap(DF(NUM_LAYERS)); // ignored
+    CHECK(key(key_u) == KEY_7);
+    layer_tap(DF(0));
+    CHECK(key(key_u) == KEY_U);
+}
+
+// keymap[] is a cache: poison an entry and see whether it comes back
+static void check_rebuild() {
+    key(key_u);
+    keymap[key_u] = 0xffff;
+    CHECK(key(key_u) == 0xffff); // same layers
+
+    layer_tap(DF(1));
+    CHECK(key(key_u) == KEY_7);   // rebuilt
+    keymap[key_u] = 0xffff;
+    layer_down(MO(1));            // already active as the default
+    CHECK(key(key_u) == 0xffff);
+    layer_up(MO(1));
+    layer_tap(DF(0));
+    CHECK(key(key_u) == KEY_U);   // rebuilt
+
+    keymap[key_u] = 0xffff;
+    layer_tap(TG(3));
+    layer_tap(TG(3));             // back where it was
+    CHECK(key(key_u) == 0xffff);
+    layer_tap(TG(3));
+    CHECK(key(key_u) == MOUSE(BTN1));
+    layer_tap(TG(3));
+    CHECK(key(key_u) == KEY_U);
+}
+
+int main() {
+    setup();
+    key_u = find_raw(KEY_U);
+    key_1 = find_raw(KEY_1);
+
+    check_momentary();
+    check_toggle();
+    check_oneshot();
+    check_default();
+    check_rebuild();
+
+    printf("test_layers: ok\n");
+    return 0;
+}
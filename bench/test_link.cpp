@@ -0,0 +1,105 @@
+// Host test of the split keyboard link.
+//
+// Both halves are built into one program (in their own namespaces)
+// with Serial1 looped back from the secondary to the primary.  Keys
+// are pressed on the secondary while the bytes in between are
+// corrupted and dropped, and once the faults stop the primary must
+// agree with the secondary about which keys are down.
+
+#define HAVE_SPLIT 1
+
+#include "host.cpp"
+
+namespace secondary {
+#define SPLIT_SECONDARY 1
+#include "main.cpp"
+}
+#undef SPLIT_SECONDARY
+
+namespace primary {
+#define SPLIT_SECONDARY 0
+#include "main.cpp"
+}
+
+static uint64_t secondary_pins[SIM_PINS]; // the primary has no keys down
+static boolean  pressed[MATRIX_KEYS];     // on the secondary
+static boolean  seen[MATRIX_KEYS];        // from the primary's raw keys
+
+static void press(int key, boolean down) {
+    uint8_t  row = secondary::keyboard_pins::rows[key / MATRIX_COLS];
+    uint64_t col = (uint64_t)1 << secondary::keyboard_pins::cols[key % MATRIX_COLS];
+    secondary_pins[row] = down ? (secondary_pins[row] | col) : (secondary_pins[row] & ~col);
+    pressed[key] = down;
+}
+
+// one scan of each half, with errors per byte (out of 1000) on the link
+static void step(int flips, int drops) {
+    memcpy(sim_pins, secondary_pins, sizeof(sim_pins));
+    secondary::loop();
+    for(unsigned i = 0; i < Serial1.tx_len; ++i) {
+        uint8_t b = Serial1.tx[i];
+        if (rand() % 1000 < drops) {
+            continue;
+        }
+        if (rand() % 1000 < flips) {
+            b ^= 1 << (rand() % 8);
+        }
+        sim_receive(&Serial1, &b, 1);
+    }
+    Serial1.tx_len = 0;
+
+    memset(sim_pins, 0, sizeof(sim_pins));
+    primary::loop();
+    for(int i = 0; i < primary::raw_count; ++i) {
+        primary::rawkey_t key = primary::raw_keys[i] & primary::raw_event::KEY;
+        boolean down = primary::raw_keys[i] & primary::raw_event::DOWN;
+        if (key >= MATRIX_KEYS) {
+            CHECK(seen[key - MATRIX_KEYS] != down); // only changes are reported
+            seen[key - MATRIX_KEYS] = down;
+        }
+    }
+}
+
+static void check_converged() {
+    for(int key = 0; key < MATRIX_KEYS; ++key) {
+        CHECK(seen[key] == pressed[key]);
+    }
+}
+
+int main() {
+    srand(1);
+    secondary::setup();
+    primary::setup();
+
+    for(int round = 0; round < 50; ++round) {
+        // a few keys at a time change while the link is bad
+        for(int i = 0; i < 200; ++i) {
+            if (rand() % 4 == 0) {
+                int key = rand() % MATRIX_KEYS;
+                press(key, !pressed[key]);
+            }
+            step(20, 20);
+        }
+        // then everything is up to date after the next keyframe
+        for(int i = 0; i < LINK_KEYFRAME_TICKS + DEBOUNCE_TIMEOUT + 2; ++i) {
+            step(0, 0);
+        }
+        check_converged();
+    }
+
+    // all keys are released if the secondary stops sending
+    press(0, true);
+    for(int i = 0; i < LINK_KEYFRAME_TICKS + DEBOUNCE_TIMEOUT + 2; ++i) {
+        step(0, 0);
+    }
+    check_converged();
+    for(int i = 0; i <= LINK_TIMEOUT_TICKS; ++i) {
+        step(0, 1000);
+    }
+    for(int key = 0; key < MATRIX_KEYS; ++key) {
+        CHECK(!seen[key]);
+    }
+
+    printf("test_link: ok\n");
+    return 0;
+}
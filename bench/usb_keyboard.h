@@ -0,0 +1,103 @@
+#pragma once
+// Host stand-in for the Teensy usb_keyboard.h and keylayouts.h
+// (only the names used by main.cpp, with the Teensy 3 values).
+#include <stdint.h>
+extern uint8_t keyboard_modifier_keys;
+extern uint8_t keyboard_keys[6];
+extern uint8_t keyboard_media_keys;
+int usb_keyboard_send();
+#define MODIFIERKEY_CTRL ( 0x01 | 0x8000 )
+#define MODIFIERKEY_SHIFT ( 0x02 | 0x8000 )
+#define MODIFIERKEY_ALT ( 0x04 | 0x8000 )
+#define MODIFIERKEY_GUI ( 0x08 | 0x8000 )
+#define MODIFIERKEY_LEFT_CTRL ( 0x01 | 0x8000 )
+#define MODIFIERKEY_LEFT_SHIFT ( 0x02 | 0x8000 )
+#define MODIFIERKEY_LEFT_ALT ( 0x04 | 0x8000 )
+#define MODIFIERKEY_LEFT_GUI ( 0x08 | 0x8000 )
+#define MODIFIERKEY_RIGHT_CTRL ( 0x10 | 0x8000 )
+#define MODIFIERKEY_RIGHT_SHIFT ( 0x20 | 0x8000 )
+#define MODIFIERKEY_RIGHT_ALT ( 0x40 | 0x8000 )
+#define MODIFIERKEY_RIGHT_GUI ( 0x80 | 0x8000 )
+#define KEY_MEDIA_VOLUME_INC 0x01
+#define KEY_MEDIA_VOLUME_DEC 0x02
+#define KEY_MEDIA_MUTE 0x04
+#define KEY_MEDIA_PLAY_PAUSE 0x08
+#define KEY_MEDIA_NEXT_TRACK 0x10
+#define KEY_MEDIA_PREV_TRACK 0x20
+#define KEY_MEDIA_STOP 0x40
+#define KEY_MEDIA_EJECT 0x80
+#define K_(n) ((n) | 0x4000)
+#define KEY_A K_(4)
+#define KEY_B K_(5)
+#define KEY_C K_(6)
+#define KEY_D K_(7)
+#define KEY_E K_(8)
+#define KEY_F K_(9)
+#define KEY_G K_(10)
+#define KEY_H K_(11)
+#define KEY_I K_(12)
+#define KEY_J K_(13)
+#define KEY_K K_(14)
+#define KEY_L K_(15)
+#define KEY_M K_(16)
+#define KEY_N K_(17)
+#define KEY_O K_(18)
+#define KEY_P K_(19)
+#define KEY_Q K_(20)
+#define KEY_R K_(21)
+#define KEY_S K_(22)
+#define KEY_T K_(23)
+#define KEY_U K_(24)
+#define KEY_V K_(25)
+#define KEY_W K_(26)
+#define KEY_X K_(27)
+#define KEY_Y K_(28)
+#define KEY_Z K_(29)
+#define KEY_1 K_(30)
+#define KEY_2 K_(31)
+#define KEY_3 K_(32)
+#define KEY_4 K_(33)
+#define KEY_5 K_(34)
+#define KEY_6 K_(35)
+#define KEY_7 K_(36)
+#define KEY_8 K_(37)
+#define KEY_9 K_(38)
+#define KEY_0 K_(39)
+#define KEY_ENTER K_(40)
+#define KEY_ESC K_(41)
+#define KEY_BACKSPACE K_(42)
+#define KEY_TAB K_(43)
+#define KEY_SPACE K_(44)
+#define KEY_MINUS K_(45)
+#define KEY_EQUAL K_(46)
+#define KEY_LEFT_BRACE K_(47)
+#define KEY_RIGHT_BRACE K_(48)
+#define KEY_BACKSLASH K_(49)
+#define KEY_SEMICOLON K_(51)
+#define KEY_QUOTE K_(52)
+#define KEY_TILDE K_(53)
+#define KEY_COMMA K_(54)
+#define KEY_PERIOD K_(55)
+#define KEY_SLASH K_(56)
+#define KEY_F1 K_(58)
+#define KEY_F2 K_(59)
+#define KEY_F3 K_(60)
+#define KEY_F4 K_(61)
+#define KEY_F5 K_(62)
+#define KEY_F6 K_(63)
+#define KEY_F7 K_(64)
+#define KEY_F8 K_(65)
+#define KEY_F9 K_(66)
+#define KEY_F10 K_(67)
+#define KEY_HOME K_(74)
+#define KEY_PAGE_UP K_(75)
+#define KEY_END K_(77)
+#define KEY_PAGE_DOWN K_(78)
+#define KEY_RIGHT K_(79)
+#define KEY_LEFT K_(80)
+#define KEY_DOWN K_(81)
+#define KEY_UP K_(82)
+#define KEYPAD_1 K_(89)
+#define KEYPAD_2 K_(90)
+#define KEY_F14 K_(105)
+#define KEY_F15 K_(106)
@@ -1,17 +1,81 @@
 #include "Arduino.h"
 #include "usb_keyboard.h"
 
-#define NUMCOLS 12
-#define NUMROWS 6
-#define NUMKEYS (NUMCOLS * NUMROWS)
+// Split keyboards have a Teensy in each half linked by a UART.
+// The half without USB is built with SPLIT_SECONDARY=1.
+#ifndef HAVE_SPLIT
+#define HAVE_SPLIT 0
+#endif
+#ifndef SPLIT_SECONDARY
+#define SPLIT_SECONDARY 0
+#endif
+
+// Key matrix geometry (the pins are in the scan section)
+// On a split keyboard, this is the matrix of one half and the
+// other half's keys are numbered from MATRIX_KEYS.
+#define MATRIX_ROWS 6
+#if HAVE_SPLIT
+#define MATRIX_COLS 6
+#else
+#define MATRIX_COLS 12
+#endif
+#define MATRIX_KEYS (MATRIX_ROWS * MATRIX_COLS)
+#ifndef NUMKEYS // (more keys can be set for extra matrices)
+#if HAVE_SPLIT
+#define NUMKEYS (2 * MATRIX_KEYS)
+#else
+#define NUMKEYS MATRIX_KEYS
+#endif
+#endif
 
-#define HAVE_TAPPERS  0
-#define HAVE_STICKIES 0
+// Raw key events are a key number with the top bit set if the key
+// was pressed.  The event word must be wide enough for NUMKEYS.
+template <typename T>
+struct raw_event_word {
+    typedef T word;
+    static const T DOWN = (T)1 << (sizeof(T) * 8 - 1);
+    static const T KEY  = DOWN - 1;
+};
+typedef raw_event_word<uint16_t> raw_event;
+typedef raw_event::word rawkey_t;
+static_assert(NUMKEYS <= raw_event::KEY, "raw event word too narrow for NUMKEYS");
+
+// Features (each can also be set on the compiler command line)
+#ifndef HAVE_TAPPERS
+#define HAVE_TAPPERS   0
+#endif
+#ifndef HAVE_STICKIES
+#define HAVE_STICKIES  0
+#endif
+#ifndef HAVE_LEADER
+#define HAVE_LEADER    1
+#endif
+#ifndef HAVE_EXPANSION
+#define HAVE_EXPANSION 1
+#endif
+#ifndef HAVE_ANALYTICS
+#define HAVE_ANALYTICS 1
+#endif
+#ifndef HAVE_POINTER
+#define HAVE_POINTER   1
+#endif
+#ifndef HAVE_JOYSTICK
+#define HAVE_JOYSTICK  0
+#endif
 
 #define DEBOUNCE_TIMEOUT 1
 #if HAVE_TAPPERS
 #define TAPPER_TIMEOUT   30
 #endif
+#if HAVE_LEADER
+#define LEADER_TIMEOUT   100
+#endif
+#if HAVE_EXPANSION
+#define EXPANSION_TIMEOUT 100
+#endif
+#if HAVE_POINTER
+#define POINTER_INTERVAL 1 // ms between mouse reports
+#endif
 
 // Modifier numbers - in same order as MODIFIERKEY_* in Teensy library
 // LAYER select are extensions
@@ -28,21 +92,39 @@
 #define LAYER2      10
 #define LAYER3      11
 
-static inline void raw_key_press(uint8_t key);
+static inline void raw_key_press(rawkey_t key);
 #if 0
-static boolean test_key(uint8_t rawkey);
+static boolean test_key(rawkey_t rawkey);
 #endif
+static void init_matrix();
 static void scan_keyboard();
+#if HAVE_SPLIT
+static void init_link();
+#if SPLIT_SECONDARY
+static void send_link();
+#else
+static void link_receive(uint8_t data);
+static void poll_link();
+#endif
+#endif
+#if !SPLIT_SECONDARY
 static void clear_keys();
-static void press_key(uint8_t raw, uint8_t key);
-static void release_key(uint8_t raw);
+static void press_key(rawkey_t raw, uint8_t key);
+static void release_key(rawkey_t raw);
 static void send_keys();
-static void send_unicode(uint16_t keycode);
+static void send_unicode(uint16_t code);
+static void send_unicode_string(const uint16_t *units, uint8_t length);
+static uint16_t unicode_codepoint(uint16_t keycode);
+static void send_string(uint8_t index);
+#if HAVE_LEADER || HAVE_EXPANSION
+static void tap_keycode(uint16_t keycode);
+#endif
 #if HAVE_TAPPERS
 static void clear_tappers();
 static void update_tappers();
 static void resolve_tappers(boolean tapper, boolean right);
-static void press_tapper(uint8_t raw, uint8_t key, uint8_t mod);
+static uint8_t tapper_modifiers();
+static void press_tapper(rawkey_t raw, uint8_t key, uint8_t mod);
 static void release_tapper(uint8_t key, uint8_t mod);
 #endif
 #if HAVE_STICKIES
@@ -51,10 +133,41 @@ static void resolve_stickies(boolean down);
 static void press_sticky(uint8_t mod);
 static void release_sticky(uint8_t mod);
 #endif
-static uint16_t find_key(uint8_t raw);
+static uint16_t find_key(rawkey_t raw);
+static uint32_t active_layers();
+static void rebuild_keymap(uint32_t mask);
+static void press_layer(uint16_t keycode);
+static void release_layer(uint16_t keycode);
+static void resolve_oneshot_layers();
 static void press_modifier(uint8_t mod);
 static void release_modifier(uint8_t mod);
+#if HAVE_LEADER
+static void start_leader();
+static void advance_leader(uint8_t key);
+static void finish_leader();
+static void update_leader();
+#endif
+#if HAVE_EXPANSION
+static void forget_typed();
+static uint8_t typed_key(uint16_t keycode);
+static void resolve_typed(uint16_t keycode);
+static void expand_typed(uint8_t key);
+static void flush_typed();
+static void update_typed();
+#endif
+#if HAVE_ANALYTICS && !SPLIT_SECONDARY
+static void record_scan();
+static void record_layer(uint8_t layer);
+static void poll_analytics();
+#endif
+#if HAVE_POINTER
+static void init_pointer();
+static void press_mouse(uint8_t action);
+static void release_mouse(uint8_t action);
+static void update_pointer();
+#endif
 static void decode();
+#endif
 
 ////////////////////////////////////////////////////////////////
 // Arduino entry points
@@ -62,34 +175,10 @@ static void decode();
 
 // the setup function runs once when you press reset or power the board
 void setup() {
-    // columns are on pins 11, 12, 14 .. 22, active low
-    pinMode(11, INPUT_PULLUP);
-    pinMode(12, INPUT_PULLUP);
-    pinMode(14, INPUT_PULLUP);
-    pinMode(15, INPUT_PULLUP);
-    pinMode(16, INPUT_PULLUP);
-    pinMode(17, INPUT_PULLUP);
-    pinMode(18, INPUT_PULLUP);
-    pinMode(19, INPUT_PULLUP);
-    pinMode(20, INPUT_PULLUP);
-    pinMode(21, INPUT_PULLUP);
-    pinMode(22, INPUT_PULLUP);
-    pinMode(23, INPUT_PULLUP);
-
-    // rows are on pins 0 .. 5, high to start with
-    pinMode(0, OUTPUT);
-    pinMode(1, OUTPUT);
-    pinMode(2, OUTPUT);
-    pinMode(3, OUTPUT);
-    pinMode(4, OUTPUT);
-    pinMode(5, OUTPUT);
-
-    digitalWrite(0, HIGH);
-    digitalWrite(1, HIGH);
-    digitalWrite(2, HIGH);
-    digitalWrite(3, HIGH);
-    digitalWrite(4, HIGH);
-    digitalWrite(5, HIGH);
+    init_matrix();
+#if HAVE_SPLIT
+    init_link();
+#endif
 
 #if 0
     // debugging aid: LED
@@ -97,6 +186,10 @@ void setup() {
     digitalWrite(13, 0);
 #endif
 
+#if !SPLIT_SECONDARY
+#if HAVE_POINTER
+    init_pointer();
+#endif
     clear_keys();
 #if HAVE_TAPPERS
     clear_tappers();
@@ -104,6 +197,7 @@ void setup() {
 #if HAVE_STICKIES
     init_stickies();
 #endif
+#endif
 }
 
 #if 0
@@ -115,6 +209,9 @@ static uint8_t prev_keys[6];
 // the loop function runs over and over again forever
 void loop() {
     scan_keyboard();
+#if HAVE_SPLIT && SPLIT_SECONDARY
+    send_link(); // the primary half does everything else
+#else
     decode();
 
 #if 0
@@ -127,8 +224,20 @@ void loop() {
 #else
     send_keys();
 #endif
+#if HAVE_ANALYTICS
+    poll_analytics();
+#endif
+#endif
 
+#if HAVE_POINTER && !SPLIT_SECONDARY
+    // sample at 100Hz, moving the pointer more often in between
+    for(int i = 0; i < 10 / POINTER_INTERVAL; ++i) {
+        delay(POINTER_INTERVAL);
+        update_pointer();
+    }
+#else
     delay(10); // sample at 100Hz
+#endif
 }
 
 ////////////////////////////////////////////////////////////////
@@ -138,25 +247,136 @@ void loop() {
 // Keys are debounced by starting a timeout when a key is pressed.
 // If the timeout is non-zero, we send a key press
 // When the timeout counts down to zero, we send a key release
-static uint8_t timeouts[NUMKEYS];
+//
+// Each row is read as a bitmask and compared with the previous state
+// so only keys that changed (or are still timing out) cost anything.
 
-// list of keys that changed state in last scan (list of raw keycodes, bit 7 set if released)
-static uint8_t raw_count = 0;
-static uint8_t raw_keys[NUMKEYS];
+// list of keys that changed state in last scan (list of raw keycodes, raw_event::DOWN set if pressed)
+static rawkey_t raw_count = 0;
+static rawkey_t raw_keys[NUMKEYS];
 
-static inline void raw_key_press(uint8_t key) {
+static inline void raw_key_press(rawkey_t key) {
     raw_keys[raw_count++] = key;
 }
 
+// A key matrix whose rows are driven low one at a time and whose
+// columns are read with pullups (so pressed keys read low).
+// Pins supplies the row and column pin numbers.
+template <uint8_t ROWS, uint8_t COLS, class Pins>
+struct pin_matrix {
+    static const uint8_t NUM_ROWS = ROWS;
+    static const uint8_t NUM_COLS = COLS;
+
+    static void init() {
+        for(int col = 0; col < COLS; ++col) {
+            pinMode(Pins::cols[col], INPUT_PULLUP);
+        }
+        for(int row = 0; row < ROWS; ++row) {
+            pinMode(Pins::rows[row], OUTPUT);
+            digitalWrite(Pins::rows[row], HIGH);
+        }
+    }
+
+    // returns bitmask of keys pressed in row
+    static uint32_t read_row(uint8_t row) {
+        uint32_t pressed = 0;
+        digitalWrite(Pins::rows[row], LOW);
+        delayMicroseconds(50);
+        for(int col = 0; col < COLS; ++col) {
+            if (!digitalRead(Pins::cols[col])) {
+                pressed |= (1u << col);
+            }
+        }
+        digitalWrite(Pins::rows[row], HIGH);
+        return pressed;
+    }
+};
+
+// Debounce state of one matrix.
+// Keys are numbered from FIRST_KEY so that several matrices can
+// report to the same list of raw keys.
+template <class Matrix, rawkey_t FIRST_KEY = 0>
+struct matrix_scanner {
+    static const rawkey_t NUM_KEYS = Matrix::NUM_ROWS * Matrix::NUM_COLS;
+    static_assert(Matrix::NUM_COLS <= 32, "matrix rows are limited to 32 columns");
+    static_assert(FIRST_KEY + NUM_KEYS <= NUMKEYS, "matrix keys do not fit in NUMKEYS");
+
+    uint32_t held[Matrix::NUM_ROWS];      // keys with non-zero timeout
+    uint32_t releasing[Matrix::NUM_ROWS]; // held keys that are timing out
+    uint8_t  timeouts[NUM_KEYS];
+
+    void init() {
+        Matrix::init();
+    }
+
+    void scan() {
+        for(uint8_t row = 0; row < Matrix::NUM_ROWS; ++row) {
+            update_row(row, Matrix::read_row(row));
+        }
+    }
+
+    void update_row(uint8_t row, uint32_t pressed) {
+        uint32_t down = held[row];
+        uint32_t work = (pressed ^ down) | releasing[row];
+        while (work) {
+            uint8_t  col = __builtin_ctz(work);
+            uint32_t bit = 1u << col;
+            rawkey_t key = row * Matrix::NUM_COLS + col;
+            work &= ~bit;
+            if (pressed & bit) { // pressed down
+                if (!(down & bit)) {
+                    raw_key_press((FIRST_KEY + key) | raw_event::DOWN); // newly pressed
+                }
+                down           |= bit;
+                releasing[row] &= ~bit;
+                timeouts[key]   = DEBOUNCE_TIMEOUT;
+            } else if (--timeouts[key] == 0) { // not pressed and timed out
+                down           &= ~bit;
+                releasing[row] &= ~bit;
+                raw_key_press(FIRST_KEY + key); // newly released
+            } else {
+                releasing[row] |= bit;
+            }
+        }
+        held[row] = down;
+    }
+};
+
+struct keyboard_pins {
+    static const uint8_t rows[MATRIX_ROWS];
+    static const uint8_t cols[MATRIX_COLS];
+};
+#if HAVE_SPLIT
+// Rows are on pins 2 .. 7 inclusive (Serial1 uses pins 0 and 1)
+// Columns are on pins 14 .. 19 inclusive
+const uint8_t keyboard_pins::rows[MATRIX_ROWS] = { 2, 3, 4, 5, 6, 7 };
+const uint8_t keyboard_pins::cols[MATRIX_COLS] = { 14, 15, 16, 17, 18, 19 };
+#else
+// Rows are on pins 0 .. 5 inclusive
+// Columns are on pins 11, 12, 14 .. 23 inclusive
+const uint8_t keyboard_pins::rows[MATRIX_ROWS] = { 0, 1, 2, 3, 4, 5 };
+const uint8_t keyboard_pins::cols[MATRIX_COLS] = { 11, 12, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23 };
+#endif
+
+typedef pin_matrix<MATRIX_ROWS, MATRIX_COLS, keyboard_pins> keyboard_matrix;
+
+// To add another matrix (eg a separate number pad), increase NUMKEYS
+// and add a matrix_scanner numbered from the end of this one.
+static matrix_scanner<keyboard_matrix> matrix;
+
+static void init_matrix() {
+    matrix.init();
+}
+
 #if 0
 // Test if key is currently pressed
-static boolean test_key(uint8_t rawkey) {
+static boolean test_key(rawkey_t rawkey) {
     for(int i = 0; i < raw_count; ++i) {
-        if (raw_keys[i] == rawkey) {
+        if ((raw_keys[i] & raw_event::KEY) == rawkey) {
             return true;
         }
     }
-    return timeouts[rawkey] != 0;
+    return matrix.timeouts[rawkey] != 0;
 }
 #endif
 
@@ -164,32 +384,348 @@ static boolean test_key(uint8_t rawkey) {
 // Writes to raw_keys
 static void scan_keyboard() {
     raw_count = 0;
-    for(int row = 0; row < NUMROWS; ++row) {
-        int rowpin = row; // Rows are on pins 0 .. 5 inclusive
-        digitalWrite(rowpin, LOW);
-        delayMicroseconds(50);
-        for(int col = 0; col < NUMCOLS; ++col) {
-            int colpin = col < 2 ? 11+col : 12+col; // Columns are on pins 11, 12, 14 .. 22 inclusive
-            int key = row * NUMCOLS + col;
-            int timeout = timeouts[key];
-            if (!digitalRead(colpin)) { // pressed down
-                if (timeout == 0) {
-                    raw_key_press(key | 0x80); // newly pressed
-                }
-                timeouts[key] = DEBOUNCE_TIMEOUT;
-            } else { // not pressed
-                if (timeout > 0) { // previously pressed
-                    --timeout;
-                    timeouts[key] = timeout;
-                    if (timeout == 0) {
-                        raw_key_press(key); // newly released
-                    }
-                }
+    matrix.scan();
+#if HAVE_SPLIT && !SPLIT_SECONDARY
+    poll_link();
+#endif
+#if HAVE_ANALYTICS && !SPLIT_SECONDARY
+    record_scan();
+#endif
+}
+
+#if HAVE_SPLIT
+////////////////////////////////////////////////////////////////
+// Split keyboard link support
+//
+// Each half of a split keyboard has its own Teensy and the two are
+// connected by a UART (Serial1).  The secondary half scans its
+// matrix and sends the changes to the primary half, which adds them
+// to raw_keys as if they came from a second matrix (numbered from
+// MATRIX_KEYS).
+//
+// Frames are:
+//     LINK_SYNC, sequence number, type, length, payload..., CRC-8
+// The payload is a bitmap of the secondary's keys - either the whole
+// bitmap (a keyframe) or the XOR with the previous frame (a delta) -
+// with runs of zero bytes compressed into (zero count, byte) pairs.
+//
+// A corrupt frame fails the CRC and a lost frame shows up as a gap in
+// the sequence numbers.  Either way, the primary ignores deltas until
+// the next keyframe, which the secondary sends every LINK_KEYFRAME
+// scans.  As a corrupt length can swallow the start of the next frame,
+// the bytes of a bad frame are searched again for LINK_SYNC.
+// If nothing arrives for LINK_TIMEOUT scans, the primary releases all
+// the secondary's keys.
+////////////////////////////////////////////////////////////////
+
+#define LINK_BAUD      115200
+#define LINK_SYNC      0xa5
+#define LINK_KEYFRAME  1
+#define LINK_DELTA     2
+#define LINK_KEYFRAME_TICKS 25  // 250ms
+#define LINK_TIMEOUT_TICKS  100 // 1s
+
+#define LINK_BITMAP  ((MATRIX_KEYS + 7) / 8)
+#define LINK_PAYLOAD (2 * LINK_BITMAP) // worst case
+#define LINK_FRAME   (LINK_PAYLOAD + 5)
+static_assert(LINK_PAYLOAD <= 255, "too many keys for link frame");
+
+static uint8_t crc8(uint8_t crc, uint8_t data) {
+    crc ^= data;
+    for(int i = 0; i < 8; ++i) {
+        crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+    }
+    return crc;
+}
+
+static uint8_t link_seq;
+
+#if SPLIT_SECONDARY
+static uint8_t link_keys[LINK_BITMAP]; // keys that are down
+static uint8_t link_sent[LINK_BITMAP]; // keys that were down in last frame
+static uint8_t link_tick;
+
+// compress bitmap into (zero count, byte) pairs
+// returns length of payload
+static uint8_t link_pack(uint8_t *payload, const uint8_t *bitmap) {
+    uint8_t len   = 0;
+    uint8_t zeros = 0;
+    for(int i = 0; i < LINK_BITMAP; ++i) {
+        if (bitmap[i] || zeros == 255) {
+            payload[len++] = zeros;
+            payload[len++] = bitmap[i];
+            zeros = 0;
+        } else {
+            ++zeros;
+        }
+    }
+    return len;
+}
+
+static void link_send(uint8_t type, const uint8_t *bitmap) {
+    uint8_t frame[LINK_FRAME];
+    uint8_t len = link_pack(frame + 4, bitmap);
+    frame[0] = LINK_SYNC;
+    frame[1] = link_seq++;
+    frame[2] = type;
+    frame[3] = len;
+    uint8_t crc = 0;
+    for(int i = 1; i < len + 4; ++i) {
+        crc = crc8(crc, frame[i]);
+    }
+    frame[len + 4] = crc;
+    Serial1.write(frame, len + 5);
+}
+
+// send any changes from the last scan to the primary half
+static void send_link() {
+    for(int i = 0; i < raw_count; ++i) {
+        rawkey_t key = raw_keys[i] & raw_event::KEY;
+        if (raw_keys[i] & raw_event::DOWN) {
+            link_keys[key / 8] |= (1 << (key % 8));
+        } else {
+            link_keys[key / 8] &= ~(1 << (key % 8));
+        }
+    }
+
+    uint8_t delta[LINK_BITMAP];
+    uint8_t changed = 0;
+    for(int i = 0; i < LINK_BITMAP; ++i) {
+        delta[i] = link_keys[i] ^ link_sent[i];
+        changed |= delta[i];
+    }
+    if (++link_tick >= LINK_KEYFRAME_TICKS) {
+        link_tick = 0;
+        link_send(LINK_KEYFRAME, link_keys);
+    } else if (changed) {
+        link_send(LINK_DELTA, delta);
+    }
+    memcpy(link_sent, link_keys, LINK_BITMAP);
+}
+
+#else // primary
+static uint8_t link_keys[LINK_BITMAP]; // secondary keys that are down
+static uint8_t link_frame[LINK_FRAME]; // frame being received
+static uint8_t link_pos;               // bytes received so far
+static boolean link_synced;            // true if deltas can be applied
+static uint8_t link_idle;              // scans since last good frame
+
+// expand payload into bitmap
+// returns false if payload is malformed
+static boolean link_unpack(uint8_t *bitmap, const uint8_t *payload, uint8_t len) {
+    if (len & 1) {
+        return false;
+    }
+    memset(bitmap, 0, LINK_BITMAP);
+    int pos = 0;
+    for(int i = 0; i < len; i += 2) {
+        pos += payload[i];
+        if (pos >= LINK_BITMAP) {
+            return false;
+        }
+        bitmap[pos++] = payload[i+1];
+    }
+    return true;
+}
+
+// report any secondary keys that have changed as raw keys
+static void link_update(const uint8_t *bitmap) {
+    for(int i = 0; i < LINK_BITMAP; ++i) {
+        uint8_t changed = link_keys[i] ^ bitmap[i];
+        while (changed) {
+            uint8_t  bit = __builtin_ctz(changed);
+            rawkey_t key = i * 8 + bit;
+            changed &= ~(1 << bit);
+            if (key < MATRIX_KEYS) {
+                boolean down = bitmap[i] & (1 << bit);
+                raw_key_press((MATRIX_KEYS + key) | (down ? raw_event::DOWN : 0));
             }
         }
-        digitalWrite(rowpin, HIGH);
+        link_keys[i] = bitmap[i];
+    }
+}
+
+// called when a complete frame has been received
+// returns false if it is corrupt
+static boolean link_receive_frame() {
+    uint8_t len = link_frame[3];
+    uint8_t crc = 0;
+    for(int i = 1; i < len + 4; ++i) {
+        crc = crc8(crc, link_frame[i]);
+    }
+    uint8_t bitmap[LINK_BITMAP];
+    if (crc != link_frame[len + 4] || !link_unpack(bitmap, link_frame + 4, len)) {
+        link_synced = false;
+        return false;
+    }
+
+    uint8_t seq  = link_frame[1];
+    uint8_t type = link_frame[2];
+    if (type == LINK_KEYFRAME) {
+        link_synced = true;
+    } else if (type == LINK_DELTA && link_synced && seq == link_seq) {
+        for(int i = 0; i < LINK_BITMAP; ++i) {
+            bitmap[i] ^= link_keys[i];
+        }
+    } else { // lost a frame: wait for next keyframe
+        link_synced = false;
+        return true;
+    }
+    link_update(bitmap);
+    link_seq  = seq + 1;
+    link_idle = 0;
+    return true;
+}
+
+// receive the bytes after the start of a bad frame again
+static void link_resync(uint8_t len) {
+    uint8_t bytes[LINK_FRAME];
+    memcpy(bytes, link_frame + 1, len - 1);
+    link_pos = 0;
+    for(int i = 0; i < len - 1; ++i) {
+        link_receive(bytes[i]);
+    }
+}
+
+static void link_receive(uint8_t data) {
+    if (link_pos == 0 && data != LINK_SYNC) {
+        return; // waiting for start of frame
+    }
+    link_frame[link_pos++] = data;
+    if (link_pos == 4 && link_frame[3] > LINK_PAYLOAD) {
+        link_resync(link_pos); // bad length
+    } else if (link_pos > 4 && link_pos == link_frame[3] + 5) {
+        link_pos = 0;
+        if (!link_receive_frame()) {
+            link_resync(link_frame[3] + 5);
+        }
+    }
+}
+
+// read frames from the secondary half
+// (stops once raw_keys might not have room for another frame)
+static void poll_link() {
+    while (raw_count <= NUMKEYS - MATRIX_KEYS && Serial1.available()) {
+        link_receive(Serial1.read());
+    }
+    if (link_idle < LINK_TIMEOUT_TICKS && ++link_idle == LINK_TIMEOUT_TICKS) {
+        uint8_t released[LINK_BITMAP];
+        memset(released, 0, LINK_BITMAP);
+        link_update(released);
+        link_synced = false;
+    }
+}
+#endif // SPLIT_SECONDARY
+
+static void init_link() {
+    Serial1.begin(LINK_BAUD);
+}
+#endif // HAVE_SPLIT
+
+#if HAVE_ANALYTICS && !SPLIT_SECONDARY
+////////////////////////////////////////////////////////////////
+// Typing analytics
+//
+// Statistics to help tune DEBOUNCE_TIMEOUT, TAPPER_TIMEOUT, etc.:
+// - number of presses of each key
+// - histogram of how long keys are held
+// - histogram of time between key presses
+// - histogram of how many keys were already down at each press
+// - number of presses on each layer
+//
+// Times are in milliseconds and histogram bucket n counts times in
+// [2^(n-1), 2^n) so a bucket is found with a count-leading-zeros
+// instruction.  All counters saturate instead of wrapping.
+//
+// On a split keyboard, the primary half records the keys of both halves.
+//
+// Sending 'd' on the USB serial port dumps the statistics in binary
+// (see analytics.py for a decoder) and 'c' clears them.
+////////////////////////////////////////////////////////////////
+
+#define ANALYTICS_BUCKETS  16 // up to 32s
+#define ANALYTICS_ROLLOVER 8
+#define ANALYTICS_LAYERS   8
+#define ANALYTICS_VERSION  1
+
+// dumped as is (little-endian) after a header
+struct analytics {
+    uint16_t presses[NUMKEYS];
+    uint16_t hold[ANALYTICS_BUCKETS];
+    uint16_t interval[ANALYTICS_BUCKETS];
+    uint16_t rollover[ANALYTICS_ROLLOVER];
+    uint16_t layers[ANALYTICS_LAYERS];
+};
+
+static struct analytics stats;
+static uint32_t pressed_at[NUMKEYS]; // time each key was pressed
+static uint32_t last_press;          // time of last key press
+static uint8_t  keys_down;           // number of keys currently down
+
+static inline void count(uint16_t *counter) {
+    if (*counter != 0xffff) {
+        ++*counter;
+    }
+}
+
+// times too long for the histogram go in the top bucket
+static inline uint8_t time_bucket(uint32_t ms) {
+    uint8_t bucket = ms ? 32 - __builtin_clz(ms) : 0;
+    return bucket < ANALYTICS_BUCKETS ? bucket : ANALYTICS_BUCKETS - 1;
+}
+
+// called after each scan with the keys that changed
+static void record_scan() {
+    if (raw_count == 0) {
+        return;
+    }
+    uint32_t now = millis();
+    for(int i = 0; i < raw_count; ++i) {
+        rawkey_t raw = raw_keys[i] & raw_event::KEY;
+        if (raw_keys[i] & raw_event::DOWN) {
+            count(&stats.presses[raw]);
+            count(&stats.interval[time_bucket(now - last_press)]);
+            count(&stats.rollover[keys_down < ANALYTICS_ROLLOVER ? keys_down : ANALYTICS_ROLLOVER - 1]);
+            pressed_at[raw] = now;
+            last_press      = now;
+            ++keys_down;
+        } else {
+            count(&stats.hold[time_bucket(now - pressed_at[raw])]);
+            if (keys_down) {
+                --keys_down;
+            }
+        }
+    }
+}
+
+// called when a key is pressed with the highest active layer
+static void record_layer(uint8_t layer) {
+    count(&stats.layers[layer < ANALYTICS_LAYERS ? layer : ANALYTICS_LAYERS - 1]);
+}
+
+static void dump_analytics() {
+    uint8_t header[8] = {
+        'T', 'K', 'A', ANALYTICS_VERSION,
+        NUMKEYS & 0xff, NUMKEYS >> 8, MATRIX_COLS, ANALYTICS_BUCKETS,
+    };
+    uint8_t sizes[2] = { ANALYTICS_ROLLOVER, ANALYTICS_LAYERS };
+    Serial.write(header, sizeof(header));
+    Serial.write(sizes, sizeof(sizes));
+    Serial.write((const uint8_t *)&stats, sizeof(stats));
+}
+
+// respond to commands on the USB serial port
+static void poll_analytics() {
+    while (Serial.available()) {
+        switch (Serial.read()) {
+            case 'd': dump_analytics(); break;
+            case 'c': memset(&stats, 0, sizeof(stats)); break;
+        }
     }
 }
+#endif // HAVE_ANALYTICS
+
+#if !SPLIT_SECONDARY // the rest is only needed by the half with USB
 
 ////////////////////////////////////////////////////////////////
 // USB Keyboard interface
@@ -201,22 +737,22 @@ static void scan_keyboard() {
 // removes the translated key from the USB buffer.
 ////////////////////////////////////////////////////////////////
 
-static uint8_t raw_press;
+static rawkey_t raw_press;
 
 static void clear_keys() {
     keyboard_modifier_keys = 0;
     for(int i = 0; i < 6; ++i) {
         keyboard_keys[i] = 0;
     }
-    raw_press = 0xff;
+    raw_press = raw_event::KEY;
 }
 
-static void press_key(uint8_t raw, uint8_t key) {
+static void press_key(rawkey_t raw, uint8_t key) {
     raw_press        = raw;
     keyboard_keys[0] = key;
 }
 
-static void release_key(uint8_t raw) {
+static void release_key(rawkey_t raw) {
     if (raw == raw_press) {
         keyboard_keys[0] = 0;
     }
@@ -242,18 +778,244 @@ static void send_key(uint16_t key) {
     delay(10);
 }
 
-static void send_unicode(uint16_t code) {
+static void send_hex(uint16_t code) {
+    for(int i = 12; i>=0; i-=4) {
+        send_key(hex_to_raw[(code >> i) & 0xf]);
+    }
+}
+
+// The string is UTF-16 (codepoints beyond 0xffff are surrogate pairs)
+static void send_unicode_string(const uint16_t *units, uint8_t length) {
     clear_keys();
     send_key(KEYPAD_2);
     keyboard_modifier_keys = (1 << LEFT_ALT);
-    for(int i = 12; i>=0; i-=4) {
-        send_key(hex_to_raw[(code >> i) & 0xf]);
+    for(int i = 0; i < length; ++i) {
+        send_hex(units[i]);
     }
     keyboard_modifier_keys = 0;
     send_key(KEYPAD_1);
     clear_keys();
 }
 
+static void send_unicode(uint16_t code) {
+    send_unicode_string(&code, 1);
+}
+
+
+#if HAVE_POINTER
+////////////////////////////////////////////////////////////////
+// Mouse pointer support
+//
+// The pointer is moved by mouse keys (MOUSE(...)) and, if
+// HAVE_JOYSTICK is set, by an analog joystick.
+// Mouse reports are sent every POINTER_INTERVAL ms (see loop) which
+// is independent of the keyboard scan.
+//
+// Speeds are fixed point with 8 fractional bits (1/256 pixel per
+// report) and the fractions are carried over to the next report.
+////////////////////////////////////////////////////////////////
+
+// Mouse keys start at MOUSE_SPEED_MIN and accelerate (quadratically)
+// to MOUSE_SPEED_MAX over 2^MOUSE_RAMP_SHIFT reports
+#define MOUSE_SPEED_MIN  64  // 250 pixels/s
+#define MOUSE_SPEED_MAX  512 // 2000 pixels/s
+#define MOUSE_RAMP_SHIFT 9   // 512ms
+#define MOUSE_WHEEL_SPEED 3  // about 12 steps/s
+
+// mouse key actions
+#define MS_UP       0
+#define MS_DOWN     1
+#define MS_LEFT     2
+#define MS_RIGHT    3
+#define MS_WH_UP    4
+#define MS_WH_DOWN  5
+#define MS_BTN1     6
+#define MS_BTN2     7
+#define MS_BTN3     8
+
+static uint16_t mouse_keys;    // bitmask of mouse key actions held
+static uint16_t mouse_ticks;   // reports since a direction was pressed
+static uint8_t  mouse_buttons; // buttons in last report
+static int32_t  pointer_frac[3]; // fractional x, y, wheel motion
+
+// speed of mouse keys after being held for ticks reports
+static int32_t mouse_key_speed(uint16_t ticks) {
+    int32_t ramp = 1 << MOUSE_RAMP_SHIFT;
+    int32_t t    = ticks < ramp ? ticks : ramp;
+    int32_t t2   = (t * t) >> MOUSE_RAMP_SHIFT;
+    return MOUSE_SPEED_MIN + (((MOUSE_SPEED_MAX - MOUSE_SPEED_MIN) * t2) >> MOUSE_RAMP_SHIFT);
+}
+
+static void press_mouse(uint8_t action) {
+    if (action <= MS_RIGHT && !(mouse_keys & 0xf)) {
+        mouse_ticks = 0;
+    }
+    mouse_keys |= (1 << action);
+}
+
+static void release_mouse(uint8_t action) {
+    mouse_keys &= ~(1 << action);
+}
+
+// add fixed point motion to an axis and return whole pixels to move
+static int8_t pointer_step(uint8_t axis, int32_t speed) {
+    int32_t total = pointer_frac[axis] + speed;
+    int32_t step  = total >> 8;
+    if (step > 127) {
+        step = 127;
+    } else if (step < -127) {
+        step = -127;
+    }
+    pointer_frac[axis] = total - (step << 8);
+    if (pointer_frac[axis] > 255 || pointer_frac[axis] < -255) {
+        pointer_frac[axis] = 0; // don't store up motion beyond the clamp
+    }
+    return step;
+}
+
+#if HAVE_JOYSTICK
+////////////////////////////////////////////////////////////////
+// Analog joystick
+//
+// Each axis is sampled 2^JOYSTICK_BATCH_SHIFT times per report and
+// averaged, centred, passed through a deadzone, scaled so that the
+// travel between the deadzone and JOYSTICK_FULL covers 0 .. 512,
+// smoothed with a first order filter and mapped to a speed by a
+// piecewise linear acceleration curve.
+////////////////////////////////////////////////////////////////
+
+#define JOYSTICK_X_PIN        A10
+#define JOYSTICK_Y_PIN        A11
+#define JOYSTICK_BATCH_SHIFT  2  // 4 samples per report
+#define JOYSTICK_DEADZONE     24  // out of 512
+#define JOYSTICK_FULL         480 // deflection for full speed (not all
+                                  // sticks reach 512 both ways)
+#define JOYSTICK_SMOOTH_SHIFT 3   // filter weight 1/8
+
+// 8 bit fixed point scale after the deadzone (rounded up so that
+// JOYSTICK_FULL gives 512)
+#define JOYSTICK_SCALE ((256 * 512 + JOYSTICK_FULL - JOYSTICK_DEADZONE - 1) / \
+                        (JOYSTICK_FULL - JOYSTICK_DEADZONE))
+
+// speed (1/256 pixels per report) at deflections 0, 64, .. 512
+static const int16_t joystick_curve[9] = {
+    0, 8, 24, 48, 96, 160, 256, 384, 512,
+};
+
+struct joystick_axis {
+    uint8_t pin;
+    int16_t centre; // raw reading at rest
+    int32_t smooth; // filtered deflection (8 fractional bits)
+};
+
+static struct joystick_axis joystick[2] = {
+    { JOYSTICK_X_PIN, 512, 0 },
+    { JOYSTICK_Y_PIN, 512, 0 },
+};
+
+static int16_t read_axis(uint8_t pin) {
+    int32_t sum = 0;
+    for(int i = 0; i < (1 << JOYSTICK_BATCH_SHIFT); ++i) {
+        sum += analogRead(pin);
+    }
+    return sum >> JOYSTICK_BATCH_SHIFT;
+}
+
+// remove deadzone from deflection (without a jump at its edge) and
+// scale the rest to -512 .. 512
+static int16_t joystick_deadzone(int16_t x) {
+    int16_t mag = x < 0 ? -x : x;
+    if (mag <= JOYSTICK_DEADZONE) {
+        return 0;
+    }
+    int32_t d = ((int32_t)(mag - JOYSTICK_DEADZONE) * JOYSTICK_SCALE) >> 8;
+    if (d > 512) {
+        d = 512;
+    }
+    return x < 0 ? -d : d;
+}
+
+// first order low-pass filter
+static int32_t joystick_filter(int32_t smooth, int16_t x) {
+    return smooth + (((int32_t)x * 256 - smooth) >> JOYSTICK_SMOOTH_SHIFT);
+}
+
+// filtered deflection rounded to the nearest whole value (halves away
+// from zero so that both directions are the same)
+static int16_t joystick_round(int32_t smooth) {
+    return smooth < 0 ? -((128 - smooth) >> 8) : (smooth + 128) >> 8;
+}
+
+// map deflection (-512 .. 512) to speed
+static int32_t joystick_speed(int16_t x) {
+    int16_t mag   = x < 0 ? -x : x;
+    int32_t speed = joystick_curve[8];
+    if (mag < 512) {
+        uint8_t i    = mag >> 6;
+        int16_t frac = mag & 63;
+        speed = (joystick_curve[i] * (64 - frac) + joystick_curve[i+1] * frac) >> 6;
+    }
+    return x < 0 ? -speed : speed;
+}
+
+static int32_t update_axis(struct joystick_axis *axis) {
+    int16_t x = joystick_deadzone(read_axis(axis->pin) - axis->centre);
+    axis->smooth = joystick_filter(axis->smooth, x);
+    return joystick_speed(joystick_round(axis->smooth));
+}
+
+static void init_joystick() {
+    for(int i = 0; i < 2; ++i) {
+        int32_t sum = 0;
+        for(int j = 0; j < 16; ++j) {
+            sum += read_axis(joystick[i].pin);
+        }
+        joystick[i].centre = sum >> 4;
+    }
+}
+#endif // HAVE_JOYSTICK
+
+static void init_pointer() {
+#if HAVE_JOYSTICK
+    init_joystick();
+#endif
+}
+
+// called every POINTER_INTERVAL ms to send a mouse report
+static void update_pointer() {
+    int32_t dx = 0;
+    int32_t dy = 0;
+    int32_t dw = 0;
+    if (mouse_keys & 0xf) {
+        int32_t speed = mouse_key_speed(mouse_ticks);
+        if (mouse_ticks < 0xffff) {
+            ++mouse_ticks;
+        }
+        if (mouse_keys & (1 << MS_UP))    dy -= speed;
+        if (mouse_keys & (1 << MS_DOWN))  dy += speed;
+        if (mouse_keys & (1 << MS_LEFT))  dx -= speed;
+        if (mouse_keys & (1 << MS_RIGHT)) dx += speed;
+    }
+    if (mouse_keys & (1 << MS_WH_UP))   dw += MOUSE_WHEEL_SPEED;
+    if (mouse_keys & (1 << MS_WH_DOWN)) dw -= MOUSE_WHEEL_SPEED;
+#if HAVE_JOYSTICK
+    dx += update_axis(&joystick[0]);
+    dy += update_axis(&joystick[1]);
+#endif
+
+    int8_t x = pointer_step(0, dx);
+    int8_t y = pointer_step(1, dy);
+    int8_t w = pointer_step(2, dw);
+    uint8_t buttons = (mouse_keys >> MS_BTN1) & 0x7;
+    if (buttons != mouse_buttons) {
+        mouse_buttons = buttons;
+        Mouse.set_buttons(buttons & 1, (buttons >> 2) & 1, (buttons >> 1) & 1);
+    }
+    if (x || y || w) {
+        Mouse.move(x, y, w);
+    }
+}
+#endif // HAVE_POINTER
 
 #if HAVE_TAPPERS
 ////////////////////////////////////////////////////////////////
@@ -267,9 +1029,9 @@ static void send_unicode(uint16_t code) {
 // keyboard.
 // While waiting to resolve, tapping modifiers are buffered
 struct tapping_state {
-    uint8_t key;
-    uint8_t raw;
-    uint8_t tick;
+    uint8_t  key;
+    rawkey_t raw;
+    uint8_t  tick;
     boolean modder;  // is the key acting as a modder?
 };
 #define NUM_TAPPERS 12
@@ -313,8 +1075,19 @@ static void resolve_tappers(boolean tapper, boolean right) {
     }
 }
 
+// modifiers held by tappers that are acting as modifiers
+static uint8_t tapper_modifiers() {
+    uint8_t modifiers = 0;
+    for(int i = 0; i < LAYER0; ++i) {
+        if (tappers[i].modder) {
+            modifiers |= (1 << i);
+        }
+    }
+    return modifiers;
+}
+
 // set tapper timer if not already running
-static void press_tapper(uint8_t raw, uint8_t key, uint8_t mod) {
+static void press_tapper(rawkey_t raw, uint8_t key, uint8_t mod) {
     if (tappers[mod].tick == 0) { // not already pressed
         tappers[mod].key    = key;
         tappers[mod].raw    = raw;
@@ -348,8 +1121,8 @@ static void release_tapper(uint8_t key, uint8_t mod) {
 ////////////////////////////////////////////////////////////////
 
 struct sticky_state {
-    uint8_t raw;
-    uint8_t state; // 0..5
+    rawkey_t raw;
+    uint8_t  state; // 0..5
 };
 #define NUM_STICKY 10
 struct sticky_state sticky[NUM_STICKY];
@@ -407,6 +1180,33 @@ static void release_sticky(uint8_t mod) {
 
 // This macro relates the physical layout of the keys to their position
 // in the key matrix
+#if HAVE_SPLIT
+// Each half is a 6x6 matrix wired as its half of the 6x12 one below.
+// The left half is the primary (keys 0 .. 35) and the right half is
+// the secondary (keys MATRIX_KEYS .. MATRIX_KEYS + 35).
+#define LAYER( \
+    K00, K01, K02, K03, K04, K05,                K06, K07, K08, K09, K0A, K0B, \
+    K10, K11, K12, K13, K14, K15,                K16, K17, K18, K19, K1A, K1B, \
+    K20, K21, K22, K23, K24, K25,                K26, K27, K28, K29, K2A, K2B, \
+    K30, K31, K32, K33, K34, K35,                K36, K37, K38, K39, K3A, K3B, \
+         K41, K42, K43, K44,                          K47, K48, K49, K4A,      \
+                                  K51, K52, K53,                               \
+                   K60, K61, K62, K63,      K64, K65, K66, K67                 \
+) { \
+    K63, K62, K61, K60, K51, 0,   \
+    K43, K42, K41, 0,   K44, 0,   \
+    K33, K32, K31, K30, K34, K35, \
+    K23, K22, K21, K20, K24, K25, \
+    K13, K12, K11, K10, K14, K15, \
+    K03, K02, K01, K00, K04, K05, \
+    K67, K66, K65, K64, K53, K52, \
+    0,   K4A, K49, K48, K47, 0,   \
+    K3B, K3A, K39, K38, K37, K36, \
+    K2B, K2A, K29, K28, K27, K26, \
+    K1B, K1A, K19, K18, K17, K16, \
+    K0B, K0A, K09, K08, K07, K06, \
+}
+#else
 #define LAYER( \
     K00, K01, K02, K03, K04, K05,                K06, K07, K08, K09, K0A, K0B, \
     K10, K11, K12, K13, K14, K15,                K16, K17, K18, K19, K1A, K1B, \
@@ -423,6 +1223,7 @@ static void release_sticky(uint8_t mod) {
     K1B, K1A, K19, K18, K17, K16, K13, K12, K11, K10, K14, K15, \
     K0B, K0A, K09, K08, K07, K06, K03, K02, K01, K00, K04, K05, \
 }
+#endif
 
 // In the teensy firmware, keys are represented by a 16-bit number
 // We extend this scheme by using some of the unused encodings
@@ -451,6 +1252,16 @@ static void release_sticky(uint8_t mod) {
 //     '101' - unicode
 //            bits 10:8 = code page (see codepage array below)
 //            bits 7:0 = codepoint<7:0>
+//     '110' - layer switch
+//            bits 10:8 = operation (LAYER_OP_* below)
+//            bits 4:0  = which layer
+//     '111' - extended keycodes
+//            bits 10:8 = which extension
+//            '000' - leader key
+//            '001' - unicode string
+//                    bits 7:0 = index into string_table (see unicode.txt)
+//            '010' - mouse key
+//                    bits 7:0 = which action (MS_* above)
 //
 #define IS_MODIFIER(k) ((k) & 0x8000)
 #define IS_NORMAL(k)   ((k) & 0x4000)
@@ -463,6 +1274,15 @@ static void release_sticky(uint8_t mod) {
 #define IS_STICKY(k)   (((k) & 0x3800) == 0x2000)
 #endif
 #define IS_UNICODE(k)  (((k) & 0x3800) == 0x2800)
+#define IS_LAYER(k)    (((k) & 0x3800) == 0x3000)
+#define IS_EXTENDED(k) (((k) & 0x3800) == 0x3800)
+#if HAVE_LEADER
+#define IS_LEADER(k)   (((k) & 0x3f00) == 0x3800)
+#endif
+#define IS_STRING(k)   (((k) & 0x3f00) == 0x3900)
+#if HAVE_POINTER
+#define IS_MOUSE(k)    (((k) & 0x3f00) == 0x3a00)
+#endif
 
 #define PAGE_MATH_ARROW    0
 #define PAGE_MATH_SYMBOL   1
@@ -482,6 +1302,49 @@ static uint16_t codepage[8] = {
     0,
 };
 
+static uint16_t unicode_codepoint(uint16_t keycode) {
+    uint8_t page = (keycode >> 8) & 0x7;
+    return codepage[page] | (keycode & 0xff);
+}
+
+// Unicode strings (STRING(n)) are for anything UNICODE(...) can't
+// produce: codepoints outside the pages above and sequences of several
+// codepoints (eg combining characters or emoji with modifiers).
+// They are generated from unicode.txt by mkstrings.py.
+#ifndef STRING_TABLE
+#define STRING_TABLE "unicode.h" // (the benchmarks use other tables)
+#endif
+#include STRING_TABLE
+
+static void send_string(uint8_t index) {
+    if (index < NUM_STRINGS) {
+        uint16_t entry = string_table[index];
+        send_unicode_string(&string_pool[entry >> 4], entry & 0xf);
+    }
+}
+
+#if HAVE_LEADER || HAVE_EXPANSION
+// send a single press and release of a keycode
+// (used when a keycode is produced by something other than a key)
+static void tap_keycode(uint16_t keycode) {
+    if (IS_UNICODE(keycode)) {
+        send_unicode(unicode_codepoint(keycode));
+    } else if (IS_STRING(keycode)) {
+        send_string(keycode & 0xff);
+    } else if (IS_NORMAL(keycode)) {
+        uint8_t modifiers = keyboard_modifier_keys;
+        if (IS_MODKEY(keycode)) {
+            uint8_t mod = (keycode >> 7) & 0xf;
+            if (mod < LAYER0) {
+                keyboard_modifier_keys |= (1 << mod);
+            }
+        }
+        send_key(keycode & 0x7f);
+        keyboard_modifier_keys = modifiers;
+    }
+}
+#endif
+
 #define MODIFIER(m) (0x8000 | (1 << (m)))
 #if HAVE_TAPPERS
 #define TAP(k,m)    (0x0800 | ((m) << 7) | (KEY_##k & 0x7f))
@@ -492,6 +1355,14 @@ static uint16_t codepage[8] = {
 #define STICKY(m)   (0x2000 | (m))
 #endif
 #define UNICODE(p,c) (0x2800 | ((p) << 8) | (c))
+#define LAYER_OP(o,l) (0x3000 | ((o) << 8) | (l))
+#define EXTENDED(e,x) (0x3800 | ((e) << 8) | (x))
+#define STRING(n)     EXTENDED(1, n)
+#if HAVE_POINTER
+#define MOUSE(a)      EXTENDED(2, MS_##a)
+#else
+#define MOUSE(a)      0
+#endif
 #define MOD(m)      MODIFIERKEY_##m
 
 #define KEY_LAYER0  MODIFIER(LAYER0)
@@ -499,6 +1370,28 @@ static uint16_t codepage[8] = {
 #define KEY_LAYER2  MODIFIER(LAYER2)
 #define KEY_LAYER3  MODIFIER(LAYER3)
 
+// Layer operations
+// - momentary: layer is active while the key is held
+// - toggle:    each press turns the layer on or off
+// - one-shot:  layer is active for the next key press only
+//              (or acts like momentary if held while other keys are pressed)
+// - default:   layer becomes the base layer
+#define LAYER_OP_MOMENTARY 0
+#define LAYER_OP_TOGGLE    1
+#define LAYER_OP_ONESHOT   2
+#define LAYER_OP_DEFAULT   3
+
+#define MO(l)  LAYER_OP(LAYER_OP_MOMENTARY, l)
+#define TG(l)  LAYER_OP(LAYER_OP_TOGGLE,    l)
+#define OSL(l) LAYER_OP(LAYER_OP_ONESHOT,   l)
+#define DF(l)  LAYER_OP(LAYER_OP_DEFAULT,   l)
+
+#if HAVE_LEADER
+#define LEADER EXTENDED(0, 0)
+#else
+#define LEADER 0
+#endif
+
 #define SHIFT(k) MODKEY(k, LEFT_SHIFT)
 
 #define KEY_DOUBLEQUOTE SHIFT(KEY_QUOTE)
@@ -529,6 +1422,13 @@ static uint16_t codepage[8] = {
 #define LGUI MODIFIERKEY_LEFT_GUI
 #define RGUI MODIFIERKEY_RIGHT_GUI
 
+// With tappers, the space bar is also shift when held with another key
+#if HAVE_TAPPERS
+#define SPACE_SHIFT TAP(SPACE, LEFT_SHIFT)
+#else
+#define SPACE_SHIFT KEY_SPACE
+#endif
+
 #define PREV_TRK   MEDIA(KEY_MEDIA_PREV_TRACK)
 #define NEXT_TRK   MEDIA(KEY_MEDIA_NEXT_TRACK)
 #define PLAY_PAUSE MEDIA(KEY_MEDIA_PLAY_PAUSE)
@@ -643,9 +1543,9 @@ static const uint16_t layers[][NUMKEYS] = {
     KEY_TAB,    KEY_Q,     KEY_W,          KEY_E,         KEY_R,       KEY_T,         KEY_Y,     KEY_U,      KEY_I,     KEY_O,          KEY_P,          KEY_LEFT_BRACE,
     KEY_ESC,    KEY_A,     KEY_S,          KEY_D,         KEY_F,       KEY_G,         KEY_H,     KEY_J,      KEY_K,     KEY_L,          KEY_SEMICOLON,  KEY_BACKSLASH,
     LSHIFT,     KEY_Z,     KEY_X,          KEY_C,         KEY_V,       KEY_B,         KEY_N,     KEY_M,      KEY_COMMA, KEY_PERIOD,     KEY_SLASH,      LSHIFT,
-                KEY_TILDE, 0,              KEY_LEFT,      KEY_RIGHT,                             KEY_DOWN,   KEY_UP,    KEY_MINUS,      KEY_EQUAL,
+                KEY_TILDE, LEADER,         KEY_LEFT,      KEY_RIGHT,                             KEY_DOWN,   KEY_UP,    KEY_MINUS,      KEY_EQUAL,
                                                                        LCTRL,  LALT,  LCTRL,
-                           RCTRL,          KEY_BACKSPACE, KEY_ESC,     LGUI,          LGUI,      KEY_ENTER,  KEY_SPACE, RCTRL
+                           RCTRL,          KEY_BACKSPACE, KEY_ESC,     LGUI,          LGUI,      KEY_ENTER,  SPACE_SHIFT, RCTRL
     ),
     // Function key layer
     [1] = // FN
@@ -669,24 +1569,24 @@ static const uint16_t layers[][NUMKEYS] = {
                                                                        0,      0,     0,
                            0,              0,             0,           0,             0,         0,          0,         0
     ),
-    // Unused
+    // Double arrows and mouse keys
     [3] = // SHIFT FN
     LAYER(
     0,          0,         0,              0,             0,           0,             0,         0,          0,         0,              0,              0,
-    0,          DARROW_LR, DARROW_L,       DARROW_R,       0,           0,             0,         0,          0,         0,              0,              0,
-    0,          0,         0,              0,             0,           0,             0,         0,          0,         0,              0,              0,
-    0,          DARROW_UD, DARROW_D,       DARROW_U,      0,           0,             0,         0,          0,         0,              0,              0,
+    0,          DARROW_LR, DARROW_L,       DARROW_R,       0,           0,             0,         MOUSE(BTN1), MOUSE(UP), MOUSE(BTN2), MOUSE(WH_UP), 0,
+    0,          0,         0,              0,             0,           0,             0,         MOUSE(LEFT), MOUSE(DOWN), MOUSE(RIGHT), MOUSE(WH_DOWN), 0,
+    0,          DARROW_UD, DARROW_D,       DARROW_U,      0,           0,             0,         MOUSE(BTN3), 0,      0,              0,              0,
                 0,         0,              0,             0,                                     0,          0,         MATH_LFATC,     MATH_RFATC,
                                                                        0,      0,     0,
                            0,              0,             0,           0,             0,         0,          0,         0
     ),
-    // Unused
+    // Unicode strings
     [4] = // ALT FN
     LAYER(
     0,          0,         0,              0,             0,           0,             0,         0,          0,         0,              0,              0,
-    0,          0,         0,              0,             0,           0,             0,         0,          0,         0,              0,              0,
-    0,          0,         0,              0,             0,           0,             0,         0,          0,         0,              0,              0,
-    0,          0,         0,              0,             0,           0,             0,         0,          0,         0,              0,              0,
+    0,          STR_SMILE, STR_WINK,       STR_THINKING,  STR_SHRUG,   0,             0,         STR_BB_N,   STR_BB_Z,  STR_BB_Q,       STR_BB_R,       0,
+    0,          STR_HEART, STR_THUMBS_UP,  STR_THUMBS_DOWN, 0,         0,             0,         STR_X_VEC,  STR_X_HAT, STR_X_BAR,      STR_NOT_ELEMENT,0,
+    0,          0,         0,              0,             0,           0,             0,         STR_SCRIPT_L, 0,       0,              0,              0,
                 0,         0,              0,             0,                                     0,          0,         0,              0,
                                                                        0,      0,     0,
                            0,              0,             0,           0,             0,         0,          0,         0
@@ -705,27 +1605,121 @@ static const uint16_t layers[][NUMKEYS] = {
 };
 
 #define NUM_LAYERS (sizeof(layers) / sizeof(layers[0]))
+static_assert(NUM_LAYERS <= 32, "layer masks are 32 bits");
 
-static uint32_t enabled_layers = (0 << 3) | (1 << 0);
+////////////////////////////////////////////////////////////////
+// Layer state
+//
+// Up to 32 layers can be active at once.  The active set is the
+// union of the default layer and any momentary, toggled, one-shot
+// or chord-selected layers; the highest active layer that has a
+// non-zero entry for a key wins.
+//
+// Rather than searching the layers on every key event, the winning
+// keycode for every key is cached in keymap[] and the cache is only
+// rebuilt when the set of active layers changes.
+////////////////////////////////////////////////////////////////
 
-static uint16_t find_key(uint8_t raw) {
-    for(int layer = NUM_LAYERS-1; layer >= 0; --layer) {
-        if (enabled_layers & (1 << layer)) {
-            uint16_t keycode = layers[layer][raw];
-            if (keycode) {
-                return keycode;
-            }
+#define LAYER_MASK (NUM_LAYERS >= 32 ? 0xffffffff : ((1u << NUM_LAYERS) - 1))
+
+static uint8_t  default_layer    = 0;
+static uint32_t momentary_layers = 0;
+static uint32_t toggled_layers   = 0;
+static uint32_t oneshot_layers   = 0;
+static uint32_t chord_layers     = 0;
+
+// one-shot layer keys that are still held down and those that were
+// held while another key was pressed (these act like momentary layers)
+static uint32_t oneshot_held     = 0;
+static uint32_t oneshot_used     = 0;
+
+// keycode of each key in the currently active layers
+static uint32_t keymap_layers = 0;
+static uint16_t keymap[NUMKEYS];
+
+// keycode each key had when it was pressed so that the release is
+// decoded the same way even if the layers have changed since
+static uint16_t pressed_keycode[NUMKEYS];
+
+static inline uint8_t top_layer(uint32_t mask) {
+    return 31 - __builtin_clz(mask); // mask must be non-zero
+}
+
+static uint32_t active_layers() {
+    uint32_t mask = (1u << default_layer)
+                  | momentary_layers
+                  | toggled_layers
+                  | oneshot_layers
+                  | chord_layers;
+    return mask & LAYER_MASK;
+}
+
+static void rebuild_keymap(uint32_t mask) {
+    for(int raw = 0; raw < NUMKEYS; ++raw) {
+        uint16_t keycode = 0;
+        for(uint32_t m = mask; m && !keycode; m &= ~(1u << top_layer(m))) {
+            keycode = layers[top_layer(m)][raw];
         }
+        keymap[raw] = keycode;
+    }
+    keymap_layers = mask;
+}
+
+static uint16_t find_key(rawkey_t raw) {
+    uint32_t mask = active_layers();
+    if (mask != keymap_layers) {
+        rebuild_keymap(mask);
     }
-    return 0;
+    return keymap[raw];
 }
 
 static void enable_layer(uint8_t layer) {
-    enabled_layers |= (1<<layer);
+    momentary_layers |= (1u << layer);
 }
 
 static void disable_layer(uint8_t layer) {
-    enabled_layers &= ~(1<<layer);
+    momentary_layers &= ~(1u << layer);
+}
+
+// the default layer is always active so it must exist
+// (otherwise no layer would be active and the keymap would be empty)
+static void set_default_layer(uint8_t layer) {
+    if (layer < NUM_LAYERS) {
+        default_layer = layer;
+    }
+}
+
+static void press_layer(uint16_t keycode) {
+    uint8_t  layer = keycode & 0x1f;
+    uint32_t bit   = 1u << layer;
+    switch ((keycode >> 8) & 0x7) {
+        case LAYER_OP_MOMENTARY: momentary_layers |= bit; break;
+        case LAYER_OP_TOGGLE:    toggled_layers   ^= bit; break;
+        case LAYER_OP_ONESHOT:   oneshot_layers   |= bit;
+                                 oneshot_held     |= bit; break;
+        case LAYER_OP_DEFAULT:   set_default_layer(layer); break;
+    }
+}
+
+static void release_layer(uint16_t keycode) {
+    uint32_t bit = 1u << (keycode & 0x1f);
+    switch ((keycode >> 8) & 0x7) {
+        case LAYER_OP_MOMENTARY: momentary_layers &= ~bit; break;
+        case LAYER_OP_ONESHOT:
+            oneshot_held &= ~bit;
+            if (oneshot_used & bit) {
+                oneshot_layers &= ~bit;
+                oneshot_used   &= ~bit;
+            }
+            break;
+    }
+}
+
+// called after a key has been pressed using any one-shot layers:
+// layers whose key was already released are used up
+static void resolve_oneshot_layers() {
+    oneshot_used   |= oneshot_held;
+    oneshot_layers &= oneshot_held;
 }
 
 static void press_modifier(uint8_t mod) {
@@ -744,18 +1738,326 @@ static void release_modifier(uint8_t mod) {
     }
 }
 
+// Modifier chords that select a layer (instead of acting as modifiers)
+struct chord {
+    uint16_t modifiers;
+    uint8_t  layer;
+};
+
+static const struct chord chords[] = {
+    { (1 << RIGHT_CTRL),                       1 }, // fn key
+    { (1 << RIGHT_CTRL) | (1 << LEFT_CTRL),    2 }, // uppercase greek
+    { (1 << RIGHT_CTRL) | (1 << LEFT_SHIFT),   3 }, // double arrows and mouse keys
+    { (1 << RIGHT_CTRL) | (1 << LEFT_ALT),     4 }, // unicode strings
+    { (1 << RIGHT_CTRL) | (1 << LEFT_GUI),     5 }, // lowercase greek
+};
+#define NUM_CHORDS (sizeof(chords) / sizeof(chords[0]))
+
+#if HAVE_LEADER || HAVE_EXPANSION
+// Key sequence tables generated by mkdfa.py (leader.h and abbrev.h)
+// are double-array tries of these
+struct dfa_node {
+    uint16_t base;    // transitions start here (0 if leaf)
+    uint16_t check;   // state that transitions to this node
+    uint16_t keycode; // keycode to produce if the sequence ends here
+};
+
+#endif
+
+#if HAVE_LEADER
+////////////////////////////////////////////////////////////////
+// Leader key support
+//
+// Pressing the leader key and then typing a short sequence of keys
+// (eg LEADER a r r) produces a symbol or other keycode.
+// The sequences are in leader.txt and are compiled into a DFA
+// (leader.h) by mkdfa.py so that each key press takes a single
+// table lookup and no RAM beyond the current state.
+//
+// If a sequence is a prefix of a longer sequence, the shorter one
+// is produced when no key is pressed within LEADER_TIMEOUT.
+// A key that does not continue any sequence cancels the leader.
+////////////////////////////////////////////////////////////////
+
+#ifndef LEADER_TABLE
+#define LEADER_TABLE "leader.h" // (the benchmarks use other tables)
+#endif
+#include LEADER_TABLE
+
+#define LEADER_IDLE 0xffff
+
+static uint16_t leader_state = LEADER_IDLE;
+static uint8_t  leader_tick;
+
+static void start_leader() {
+    leader_state = 0;
+    leader_tick  = LEADER_TIMEOUT;
+}
+
+static void advance_leader(uint8_t key) {
+    uint8_t  c = leader_class[key];
+    uint16_t t = leader_dfa[leader_state].base + c;
+    if (c == 0 || leader_dfa[t].check != leader_state) { // no such sequence
+        leader_state = LEADER_IDLE;
+        return;
+    }
+    leader_state = t;
+    leader_tick  = LEADER_TIMEOUT;
+    if (leader_dfa[t].base == 0) { // no longer sequences
+        finish_leader();
+    }
+}
+
+static void finish_leader() {
+    uint16_t keycode = leader_dfa[leader_state].keycode;
+    leader_state = LEADER_IDLE;
+    if (keycode) {
+        tap_keycode(keycode);
+#if HAVE_EXPANSION
+        forget_typed();
+#endif
+    }
+}
+
+// decrement leader timer and produce current match if timed out
+static void update_leader() {
+    if (leader_state != LEADER_IDLE && --leader_tick == 0) {
+        finish_leader();
+    }
+}
+#endif // HAVE_LEADER
+
+#if HAVE_EXPANSION
+////////////////////////////////////////////////////////////////
+// Text expansion support
+//
+// The most recently typed keys are kept in a small ring buffer.
+// When the end of what has been typed matches an abbreviation in
+// abbrev.txt (eg "->"), the abbreviation is deleted with backspaces
+// and replaced by the corresponding keycode (eg ARROW_R).
+//
+// The abbreviations are compiled (last character first) into a DFA
+// (abbrev.h) by mkdfa.py.  After each key, the DFA is run backwards
+// over the ring buffer so the cost per key depends only on the
+// length of the longest abbreviation, not on how many there are.
+//
+// An abbreviation that is the start of a longer one (eg "<-" and
+// "<->") is held back until a key that does not continue the longer
+// one is pressed, or until no key is pressed within EXPANSION_TIMEOUT.
+// mkdfa.py makes a second, forward DFA of those abbreviations to
+// follow them key by key.
+////////////////////////////////////////////////////////////////
+
+#ifndef ABBREV_TABLE
+#define ABBREV_TABLE "abbrev.h" // (the benchmarks use other tables)
+#endif
+#include ABBREV_TABLE
+
+// Each entry is a key number with bit 7 set if shift was held
+// (0 is used as a barrier that no abbreviation can match across)
+#define TYPED_SIZE 16 // must be a power of 2
+static_assert(ABBREV_MAXLEN <= TYPED_SIZE, "abbreviation too long for typed buffer");
+
+static uint8_t typed[TYPED_SIZE];
+static uint8_t typed_next  = 0; // where the next key goes
+static uint8_t typed_count = 0; // number of keys in buffer
+
+// abbreviation waiting to see if a longer one is typed
+// (followed by pending_extra keys that may start the rest of it)
+static uint16_t pending_keycode = 0; // 0 if none
+static uint16_t pending_state;       // in abbrev_fwd
+static uint8_t  pending_length;
+static uint8_t  pending_extra;
+static uint8_t  pending_tick;
+
+static void forget_typed() {
+    typed_count     = 0;
+    pending_keycode = 0;
+}
+
+// entry for typed[] when keycode is typed (0 for shortcuts and keys
+// such as the arrows, which are not text)
+static uint8_t typed_key(uint16_t keycode) {
+    uint8_t key = keycode & 0x7f;
+    if (key < (KEY_A & 0x7f) || key > (KEY_SLASH & 0x7f) || key == (KEY_ESC & 0x7f)) {
+        return 0;
+    }
+    uint8_t modifiers = keyboard_modifier_keys;
+    if (IS_MODKEY(keycode)) {
+        modifiers |= (1 << ((keycode >> 7) & 0xf));
+    }
+    if (modifiers & ~((1 << LEFT_SHIFT) | (1 << RIGHT_SHIFT))) {
+        return 0;
+    }
+    return key | (modifiers ? 0x80 : 0);
+}
+
+// expand the pending abbreviation before anything but a key that
+// continues a longer one (or a backspace, which cancels it)
+static void resolve_typed(uint16_t keycode) {
+    if (!pending_keycode) {
+        return;
+    }
+    if (IS_NORMAL(keycode)) {
+        uint8_t key = typed_key(keycode);
+        if (key == (KEY_BACKSPACE & 0x7f)) {
+            return;
+        }
+        uint8_t  c = abbrev_class[key];
+        uint16_t t = abbrev_fwd[pending_state].base + c;
+        if (c != 0 && abbrev_fwd[t].check == pending_state) {
+            return;
+        }
+    }
+    flush_typed();
+}
+
+static void push_typed(uint8_t key) {
+    typed[typed_next] = key;
+    typed_next = (typed_next + 1) & (TYPED_SIZE - 1);
+    if (typed_count < TYPED_SIZE) {
+        ++typed_count;
+    }
+}
+
+static void pop_typed(uint8_t count) {
+    typed_next   = (typed_next - count) & (TYPED_SIZE - 1);
+    typed_count -= count;
+}
+
+// called after each key is typed
+static void expand_typed(uint8_t key) {
+    if (key == (KEY_BACKSPACE & 0x7f)) {
+        pending_keycode = 0;
+        if (typed_count) {
+            pop_typed(1);
+        }
+        return;
+    }
+    push_typed(key);
+
+    if (pending_keycode) {
+        uint8_t  c = abbrev_class[key];
+        uint16_t t = abbrev_fwd[pending_state].base + c;
+        ++pending_extra;
+        if (c == 0 || abbrev_fwd[t].check != pending_state) {
+            // resolve_typed expected another key (the modifiers have
+            // changed since) so expand it and retype this one
+            flush_typed();
+        } else { // key continues a longer abbreviation
+            pending_state = t;
+            pending_tick  = EXPANSION_TIMEOUT;
+            if (abbrev_fwd[t].base != 0) {
+                if (abbrev_fwd[t].keycode) { // and there may be a longer one
+                    pending_keycode = abbrev_fwd[t].keycode;
+                    pending_length += pending_extra;
+                    pending_extra   = 0;
+                }
+                return;
+            }
+            pending_keycode = 0; // the longest one, which is found below
+        }
+    }
+
+    // find longest abbreviation that matches end of buffer
+    uint16_t state   = 0;
+    uint16_t keycode = 0;
+    uint8_t  length  = 0;
+    uint8_t  limit   = typed_count < ABBREV_MAXLEN ? typed_count : ABBREV_MAXLEN;
+    uint8_t  pos     = typed_next;
+    for(uint8_t i = 1; i <= limit; ++i) {
+        pos = (pos - 1) & (TYPED_SIZE - 1);
+        uint8_t  c = abbrev_class[typed[pos]];
+        uint16_t t = abbrev_dfa[state].base + c;
+        if (c == 0 || abbrev_dfa[t].check != state) {
+            break;
+        }
+        state = t;
+        if (abbrev_dfa[t].keycode) {
+            keycode = abbrev_dfa[t].keycode;
+            length  = i;
+        }
+    }
+
+    if (!keycode) {
+        return;
+    }
+
+    // wait if it is the start of a longer abbreviation
+    uint8_t i = 0;
+    for(state = 0; i < length; ++i) {
+        uint8_t  c = abbrev_class[typed[(typed_next - length + i) & (TYPED_SIZE - 1)]];
+        uint16_t t = abbrev_fwd[state].base + c;
+        if (c == 0 || abbrev_fwd[t].check != state) {
+            break;
+        }
+        state = t;
+    }
+    if (i == length && abbrev_fwd[state].base != 0) {
+        pending_keycode = keycode;
+        pending_state   = state;
+        pending_length  = length;
+        pending_extra   = 0;
+        pending_tick    = EXPANSION_TIMEOUT;
+        return;
+    }
+
+    send_keys(); // make sure the last key has been typed
+    clear_keys();
+    send_keys();
+    for(uint8_t i = 0; i < length; ++i) {
+        send_key(KEY_BACKSPACE);
+    }
+    tap_keycode(keycode);
+    pop_typed(length);
+    push_typed(0);
+}
+
+// expand the pending abbreviation and retype the keys after it
+// (the modifiers are kept for the key being pressed)
+static void flush_typed() {
+    uint8_t extra[TYPED_SIZE];
+    uint8_t modifiers = keyboard_modifier_keys;
+    for(uint8_t i = 0; i < pending_extra; ++i) {
+        extra[i] = typed[(typed_next - pending_extra + i) & (TYPED_SIZE - 1)];
+    }
+    clear_keys();
+    send_keys();
+    for(uint8_t i = 0; i < pending_length + pending_extra; ++i) {
+        send_key(KEY_BACKSPACE);
+    }
+    tap_keycode(pending_keycode);
+    pop_typed(pending_length + pending_extra);
+    push_typed(0);
+    for(uint8_t i = 0; i < pending_extra; ++i) {
+        keyboard_modifier_keys = (extra[i] & 0x80) ? (1 << LEFT_SHIFT) : 0;
+        send_key(extra[i] & 0x7f);
+        push_typed(extra[i]);
+    }
+    keyboard_modifier_keys = modifiers;
+    pending_keycode = 0;
+}
+
+// produce the pending abbreviation if timed out
+static void update_typed() {
+    if (pending_keycode && --pending_tick == 0) {
+        flush_typed();
+    }
+}
+#endif // HAVE_EXPANSION
+
 uint16_t raw_modifiers = 0;
 
 // decode raw keypresses and put in USB buffer or tapper buffer
 static void decode() {
-    enabled_layers = 1;
     // first resolve any tappers and modifiers - which may affect
     // the meaning of other keys and which layers are enabled
     for(int i = 0; i < raw_count; ++i) {
-        uint8_t raw = raw_keys[i];
-        boolean down = raw & 0x80;
-        raw = raw & 0x7f;
-        uint16_t keycode = find_key(raw);
+        rawkey_t raw = raw_keys[i];
+        boolean down = raw & raw_event::DOWN;
+        raw = raw & raw_event::KEY;
+        uint16_t keycode = down ? find_key(raw) : pressed_keycode[raw];
+        pressed_keycode[raw] = keycode;
 #if HAVE_TAPPERS
         if (IS_NORMAL(keycode)) { // normal key
             if (down) {
@@ -772,47 +2074,70 @@ static void decode() {
         if (IS_MODIFIER(keycode)) { // modifier key
             if (down) {
                 raw_modifiers          |= (keycode & 0xff);
-                enabled_layers         |= ((keycode >> LAYER0) & 0xf);
+                momentary_layers       |= ((keycode >> LAYER0) & 0xf);
             } else {
                 raw_modifiers          &= ~(keycode & 0xff);
-                enabled_layers         &= ~((keycode >> LAYER0) & 0xf);
+                momentary_layers       &= ~((keycode >> LAYER0) & 0xf);
+            }
+        } else if (IS_LAYER(keycode)) { // layer switch
+            if (down) {
+                press_layer(keycode);
+            } else {
+                release_layer(keycode);
             }
         }
     }
 
-    if (raw_modifiers == ((1 << RIGHT_CTRL))) { // fn key
-        enabled_layers = 3;
-        keyboard_modifier_keys = 0;
-    } else if (raw_modifiers == ((1 << RIGHT_CTRL) | (1 << LEFT_CTRL))) { // uppercase greek
-        enabled_layers = 5;
-        keyboard_modifier_keys = 0;
-    } else if (raw_modifiers == ((1 << RIGHT_CTRL) | (1 << LEFT_SHIFT))) { // unused
-        enabled_layers = 9;
-        keyboard_modifier_keys = 0;
-    } else if (raw_modifiers == ((1 << RIGHT_CTRL) | (1 << LEFT_ALT))) { // unused
-        enabled_layers = 17;
-        keyboard_modifier_keys = 0;
-    } else if (raw_modifiers == ((1 << RIGHT_CTRL) | (1 << LEFT_GUI))) { // lowercase greek
-        enabled_layers = 33;
-        keyboard_modifier_keys = 0;
-    } else {
-        enabled_layers = 1;
-        keyboard_modifier_keys = raw_modifiers & 0xf;
+    chord_layers = 0;
+    keyboard_modifier_keys = raw_modifiers & 0xf;
+    for(unsigned i = 0; i < NUM_CHORDS; ++i) {
+        if (raw_modifiers == chords[i].modifiers) {
+            chord_layers = (1u << chords[i].layer);
+            keyboard_modifier_keys = 0;
+            break;
+        }
     }
+#if HAVE_TAPPERS
+    keyboard_modifier_keys |= tapper_modifiers();
+#endif
 
     // now deal with any keys
     for(int i = 0; i < raw_count; ++i) {
-        uint8_t raw = raw_keys[i];
-        boolean down = raw & 0x80;
-        raw = raw & 0x7f;
-        uint16_t keycode = find_key(raw);
+        rawkey_t raw = raw_keys[i];
+        boolean down = raw & raw_event::DOWN;
+        raw = raw & raw_event::KEY;
+        uint16_t keycode = pressed_keycode[raw];
+        if (IS_MODIFIER(keycode) || IS_LAYER(keycode)) {
+            continue; // already dealt with
+        }
+        if (down) { // layers may have changed since first pass
+            keycode = find_key(raw);
+            pressed_keycode[raw] = keycode;
+            resolve_oneshot_layers();
+#if HAVE_ANALYTICS
+            record_layer(top_layer(keymap_layers));
+#endif
+        }
 
-        // search layers for keycode
+#if HAVE_EXPANSION
+        if (down) {
+            resolve_typed(keycode);
+        }
+#endif
+#if HAVE_LEADER
+        if (down && leader_state != LEADER_IDLE && IS_NORMAL(keycode)) {
+            advance_leader(keycode & 0x7f);
+            continue;
+        }
+#endif
         if (IS_NORMAL(keycode)) { // normal key
 #if HAVE_STICKIES
             resolve_stickies(down);
 #endif
             if (down) {
+#if HAVE_EXPANSION
+                uint8_t key = typed_key(keycode);
+#endif
                 press_key(raw, keycode & 0x7f);
                 if (IS_MODKEY(keycode)) {
                     uint8_t mod = (keycode >> 7) & 0xf;
@@ -823,6 +2148,13 @@ static void decode() {
                 } else {
                     press_key(raw, keycode & 0x7f);
                 }
+#if HAVE_EXPANSION
+                if (key) {
+                    expand_typed(key);
+                } else {
+                    forget_typed(); // a shortcut or cursor key, not text
+                }
+#endif
             } else {
                 release_key(raw);
             }
@@ -830,7 +2162,9 @@ static void decode() {
         } else if (IS_TAPPING(keycode)) {
             uint8_t mod = (keycode >> 7) & 0xf;
             uint8_t key = keycode & 0x7f;
+#if HAVE_STICKIES
             resolve_stickies(down);
+#endif
             if (down) {
                 press_tapper(raw, key, mod);
             } else {
@@ -855,10 +2189,37 @@ static void decode() {
             }
         } else if (IS_UNICODE(keycode)) {
             if (down) {
-                uint8_t  page = (keycode >> 8) & 0x7;
-                uint16_t codepoint = codepage[page] | (keycode & 0xff);
-                send_unicode(codepoint);
+                send_unicode(unicode_codepoint(keycode));
+#if HAVE_EXPANSION
+                forget_typed();
+#endif
+            }
+        } else if (IS_STRING(keycode)) {
+            if (down) {
+                send_string(keycode & 0xff);
+#if HAVE_EXPANSION
+                forget_typed();
+#endif
+            }
+#if HAVE_POINTER
+        } else if (IS_MOUSE(keycode)) {
+            if (down) {
+                press_mouse(keycode & 0xff);
+#if HAVE_EXPANSION
+                if ((keycode & 0xff) >= MS_BTN1) {
+                    forget_typed(); // a click may move the text cursor
+                }
+#endif
+            } else {
+                release_mouse(keycode & 0xff);
             }
+#endif
+#if HAVE_LEADER
+        } else if (IS_LEADER(keycode)) {
+            if (down) {
+                start_leader();
+            }
+#endif
         } else {
             // ignore anything else
         }
@@ -866,7 +2227,14 @@ static void decode() {
 #if HAVE_TAPPERS
     update_tappers();
 #endif
+#if HAVE_LEADER
+    update_leader();
+#endif
+#if HAVE_EXPANSION
+    update_typed();
+#endif
 }
+#endif // !SPLIT_SECONDARY
 
 ////////////////////////////////////////////////////////////////
 // End
@@ -0,0 +1,221 @@
+#!/usr/bin/env python3
+#
+# Compile a list of key sequences into a DFA table for the firmware.
+#
+# Usage: mkdfa.py NAME [--layout qwerty|dvorak] [--shift] [--reverse]
+#                 < NAME.txt > NAME.h
+#
+# Each line of the input is a sequence of characters followed by the
+# keycode to produce when the sequence has been typed.  The keycode is
+# copied into the table as-is so it can use any of the macros defined in
+# main.cpp (eg UNICODE(...) or KEY_*).  Lines starting with '#' are ignored.
+# Sequences containing spaces can be written in double quotes.
+#
+#     arr         DARROW_R
+#     "forall "   MATH_FORALL
+#
+# Characters are translated into the HID usages that produce them with the
+# selected host keyboard layout (the host does the Dvorak translation for
+# the "Software Dvorak" keymap in main.cpp).
+# With --shift, characters that need shift are allowed and bit 7 of the
+# input is set if shift is held (so the class table has 256 entries).
+# With --reverse, sequences are stored last character first so that the
+# DFA can be used to match the end of what has been typed.  A second,
+# forward DFA (NAME_fwd) is also made of the sequences that are the start
+# of a longer sequence and the longer sequences, so that the firmware can
+# wait for the next key before expanding the shorter one.
+#
+# The DFA is stored as a double-array trie: each state s has a base and
+# the transition on input class c goes to slot t = base[s] + c if check[t]
+# is s.  This needs a single table lookup per key no matter how many
+# sequences there are.  Characters are first mapped to a small number of
+# input classes by a 128 entry table (class 0 means "no transition").
+# Leaves have base 0.  The table is padded so that base[s] + c never
+# goes past the end of the table.
+
+import sys
+from collections import deque
+
+QWERTY_USAGE = {}
+for i, ch in enumerate("abcdefghijklmnopqrstuvwxyz"):
+    QWERTY_USAGE[ch] = 4 + i
+for i, ch in enumerate("1234567890"):
+    QWERTY_USAGE[ch] = 30 + i
+for ch, usage in [(" ", 44), ("-", 45), ("=", 46), ("[", 47), ("]", 48),
+                  ("\\", 49), (";", 51), ("'", 52), ("`", 53), (",", 54),
+                  (".", 55), ("/", 56)]:
+    QWERTY_USAGE[ch] = usage
+
+# character typed with Dvorak -> key with that position on a Qwerty keyboard
+DVORAK_TO_QWERTY = dict(zip(
+    "[]',.pyfgcrl/=aoeuidhtns-;qjkxbmwvz",
+    "-=qwertyuiop[]asdfghjkl;'zxcvbnm,./"))
+
+# shifted character -> unshifted character (the same for Qwerty and Dvorak)
+UNSHIFT = dict(zip(
+    '~!@#$%^&*()_+{}|:"<>?',
+    "`1234567890-=[]\\;',./"))
+for ch in "abcdefghijklmnopqrstuvwxyz":
+    UNSHIFT[ch.upper()] = ch
+
+def usage_of(ch, layout, shift):
+    shifted = ch in UNSHIFT
+    if shifted:
+        if not shift:
+            sys.exit("mkdfa: %r needs shift (use --shift)" % ch)
+        ch = UNSHIFT[ch]
+    if layout == "dvorak":
+        ch = DVORAK_TO_QWERTY.get(ch, ch)
+    if ch not in QWERTY_USAGE:
+        sys.exit("mkdfa: cannot type character %r" % ch)
+    return QWERTY_USAGE[ch] | (0x80 if shifted else 0)
+
+def parse(lines, layout, shift):
+    entries = []
+    for lineno, line in enumerate(lines, 1):
+        line = line.strip()
+        if not line or line.startswith("#"):
+            continue
+        if line.startswith('"'):
+            end = line.find('"', 1)
+            if end < 2:
+                sys.exit("mkdfa: line %d: bad quoted sequence" % lineno)
+            fields = [line[1:end], line[end + 1:]]
+        else:
+            fields = line.split(None, 1)
+        if len(fields) != 2 or not fields[1].strip():
+            sys.exit("mkdfa: line %d: expected sequence and keycode" % lineno)
+        seq = [usage_of(ch, layout, shift) for ch in fields[0]]
+        entries.append((seq, fields[1].strip()))
+    return entries
+
+def build_trie(entries):
+    # trie nodes are dicts: usage -> child, plus output in node[None]
+    root = {}
+    for seq, out in entries:
+        node = root
+        for usage in seq:
+            node = node.setdefault(usage, {})
+        if None in node:
+            sys.exit("mkdfa: duplicate sequence for %s" % out)
+        node[None] = out
+    return root
+
+def build_double_array(root, classes):
+    base  = [1]
+    check = [-1]
+    out   = ["0"]
+    used  = bytearray(1)
+    queue = deque([(root, 0)])
+    while queue:
+        node, s = queue.popleft()
+        if None in node:
+            out[s] = node[None]
+        kids = sorted((classes[u], child) for u, child in node.items() if u is not None)
+        if not kids:
+            base[s] = 0
+            continue
+        # try each free slot for the first child until all children fit
+        first, last = kids[0][0], kids[-1][0]
+        pos = first + 1
+        while True:
+            free = used.find(0, pos)
+            if free >= 0:
+                pos = free
+            elif pos < len(used):
+                pos = len(used)
+            b = pos - first
+            if len(used) <= b + last:
+                used.extend(bytes(b + last + 1 - len(used)))
+            if all(not used[b + c] for c, _ in kids):
+                break
+            pos += 1
+        base[s] = b
+        for c, child in kids:
+            t = b + c
+            used[t] = 1
+            while len(base) <= t:
+                base.append(0)
+                check.append(-1)
+                out.append("0")
+            check[t] = s
+            queue.append((child, t))
+    # pad so that base[s] + c is always in range
+    size = max(base) + len(set(classes.values())) + 1
+    while len(base) < size:
+        base.append(0)
+        check.append(-1)
+        out.append("0")
+    return base, check, out
+
+# sequences that start a longer sequence, and the longer sequences
+def prefix_conflicts(entries):
+    seqs = [tuple(seq) for seq, _ in entries]
+    starts = {seq[:i] for seq in seqs for i in range(1, len(seq))}
+    shorter = {seq for seq in seqs if seq in starts}
+    return [(seq, out) for seq, out in entries
+            if tuple(seq) in shorter
+            or any(tuple(seq[:i]) in shorter for i in range(1, len(seq)))]
+
+def print_dfa(name, table, base, check, out):
+    print("static const struct dfa_node %s_%s[%s_%s_SIZE] = {"
+          % (name, table, name.upper(), table.upper()))
+    for b, c, o in zip(base, check, out):
+        print("    { %d, 0x%04x, %s }," % (b, c & 0xffff, o))
+    print("};")
+
+def main():
+    args = sys.argv[1:]
+    layout = "qwerty"
+    shift = "--shift" in args
+    reverse = "--reverse" in args
+    args = [a for a in args if a not in ("--shift", "--reverse")]
+    if "--layout" in args:
+        i = args.index("--layout")
+        layout = args[i + 1]
+        del args[i:i + 2]
+    if len(args) != 1 or layout not in ("qwerty", "dvorak"):
+        sys.exit("usage: mkdfa.py NAME [--layout qwerty|dvorak] [--shift] [--reverse] < NAME.txt > NAME.h")
+    name = args[0]
+
+    entries = parse(sys.stdin, layout, shift)
+    if not entries:
+        sys.exit("mkdfa: no sequences")
+    maxlen = max(len(seq) for seq, _ in entries)
+    inputs = 256 if shift else 128
+    usages  = sorted({u for seq, _ in entries for u in seq})
+    classes = {u: i + 1 for i, u in enumerate(usages)}
+    forward = []
+    if reverse:
+        forward = build_double_array(build_trie(prefix_conflicts(entries)), classes)
+        entries = [(seq[::-1], out) for seq, out in entries]
+    base, check, out = build_double_array(build_trie(entries), classes)
+    if len(base) >= 0xffff:
+        sys.exit("mkdfa: too many states")
+
+    print("// Generated by mkdfa.py from %s.txt - do not edit" % name)
+    print("// %d sequences, %d input classes, %d slots" % (len(entries), len(classes), len(base)))
+    print()
+    print("#define %s_DFA_SIZE %d" % (name.upper(), len(base)))
+    if forward:
+        print("#define %s_FWD_SIZE %d" % (name.upper(), len(forward[0])))
+    print("#define %s_MAXLEN   %d" % (name.upper(), maxlen))
+    print()
+    print("static const uint8_t %s_class[%d] = {" % (name, inputs))
+    row = [str(classes.get(u, 0)) for u in range(inputs)]
+    for i in range(0, inputs, 16):
+        print("    " + ", ".join(row[i:i + 16]) + ",")
+    print("};")
+    print()
+    print_dfa(name, "dfa", base, check, out)
+    if forward:
+        print()
+        print_dfa(name, "fwd", *forward)
+
+    flash = inputs + 6 * len(base)
+    if forward:
+        flash += 6 * len(forward[0])
+    sys.stderr.write("mkdfa: %s: %d sequences, %d slots, %d bytes\n" % (name, len(entries), len(base), flash))
+
+if __name__ == "__main__":
+    main()
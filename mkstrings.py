@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+#
+# Compile a list of Unicode strings into a string pool for the firmware.
+#
+# Usage: mkstrings.py < unicode.txt > unicode.h
+#
+# Each line of the input is a name followed by the codepoints of the
+# string, written as U+XXXX or as a double quoted literal.
+# Lines starting with '#' are ignored.
+#
+#     THUMBS_UP_DARK   U+1F44D U+1F3FF
+#     E_ACUTE          "e" U+0301
+#
+# This defines STR_<name> as a keycode (STRING(n)) that types the string.
+#
+# All the strings are stored as UTF-16 (the form they are typed in) in
+# a single pool.  Identical strings get the same index and a string that
+# already appears in the pool (eg as the prefix of a longer string) is
+# not stored again.  The string table holds the offset and length of
+# each string in 16 bits so lookup is a single index.
+#
+# The pool and table sizes are printed on stderr and in the header
+# (STRING_PER_KEY_BYTES) along with what the strings would take if each
+# key stored its own UTF-16 string and length, without sharing.
+
+import sys
+
+MAX_STRINGS = 256       # STRING(n) has an 8 bit index
+MAX_LENGTH  = 15        # UTF-16 code units (4 bits in the table)
+MAX_POOL    = 1 << 12   # code units (12 bits in the table)
+
+def parse_codepoints(text, lineno):
+    codepoints = []
+    while text:
+        text = text.lstrip()
+        if not text:
+            break
+        if text.startswith('"'):
+            end = text.find('"', 1)
+            if end < 0:
+                sys.exit("mkstrings: line %d: unterminated string" % lineno)
+            codepoints.extend(ord(ch) for ch in text[1:end])
+            text = text[end + 1:]
+        else:
+            fields = text.split(None, 1)
+            word = fields[0]
+            text = fields[1] if len(fields) > 1 else ""
+            if not word.upper().startswith("U+"):
+                sys.exit("mkstrings: line %d: bad codepoint %r" % (lineno, word))
+            codepoint = int(word[2:], 16)
+            if codepoint > 0x10ffff or 0xd800 <= codepoint <= 0xdfff:
+                sys.exit("mkstrings: line %d: invalid codepoint %r" % (lineno, word))
+            codepoints.append(codepoint)
+    return codepoints
+
+def parse(lines):
+    entries = []
+    for lineno, line in enumerate(lines, 1):
+        line = line.strip()
+        if not line or line.startswith("#"):
+            continue
+        fields = line.split(None, 1)
+        if len(fields) != 2:
+            sys.exit("mkstrings: line %d: expected name and string" % lineno)
+        name, rest = fields
+        codepoints = parse_codepoints(rest, lineno)
+        if not codepoints:
+            sys.exit("mkstrings: line %d: empty string" % lineno)
+        units = utf16(codepoints)
+        if len(units) > MAX_LENGTH:
+            sys.exit("mkstrings: line %d: string longer than %d UTF-16 units" % (lineno, MAX_LENGTH))
+        entries.append((name, units))
+    return entries
+
+def utf16(codepoints):
+    units = []
+    for c in codepoints:
+        if c > 0xffff:
+            c -= 0x10000
+            units.extend((0xd800 | (c >> 10), 0xdc00 | (c & 0x3ff)))
+        else:
+            units.append(c)
+    return tuple(units)
+
+def find(pool, s):
+    n = len(s)
+    for i in range(len(pool) - n + 1):
+        if tuple(pool[i:i + n]) == s:
+            return i
+    return -1
+
+def build_pool(strings):
+    # add longest strings first so shorter ones can share them
+    pool = []
+    offsets = {}
+    for s in sorted(strings, key=len, reverse=True):
+        offset = find(pool, s)
+        if offset < 0:
+            # reuse any overlap with the end of the pool
+            overlap = 0
+            for k in range(min(len(s), len(pool)) - 1, 0, -1):
+                if tuple(pool[-k:]) == s[:k]:
+                    overlap = k
+                    break
+            offset = len(pool) - overlap
+            pool.extend(s[overlap:])
+        offsets[s] = offset
+    return pool, offsets
+
+def main():
+    entries = parse(sys.stdin)
+    names = set()
+    strings = []
+    for name, s in entries:
+        if name in names:
+            sys.exit("mkstrings: duplicate name %s" % name)
+        names.add(name)
+        if s not in strings:
+            strings.append(s)
+    if len(strings) > MAX_STRINGS:
+        sys.exit("mkstrings: too many strings")
+    pool, offsets = build_pool(strings)
+    if len(pool) > MAX_POOL:
+        sys.exit("mkstrings: string pool too large")
+    flash = 2 * len(pool) + 2 * len(strings)
+    per_key = sum(2 * len(s) + 2 for name, s in entries)
+
+    print("// Generated by mkstrings.py from unicode.txt - do not edit")
+    print("// %d names, %d strings, %d UTF-16 units" % (len(entries), len(strings), len(pool)))
+    print()
+    for name, s in entries:
+        print("#define STR_%-20s STRING(%d)" % (name, strings.index(s)))
+    print()
+    print("#define NUM_STRINGS %d" % len(strings))
+    print()
+    print("// bytes if each key had its own string and length (for comparison)")
+    print("#define STRING_PER_KEY_BYTES %d" % per_key)
+    print()
+    print("static const uint16_t string_pool[%d] = {" % len(pool))
+    for i in range(0, len(pool), 8):
+        print("    " + ", ".join("0x%04x" % c for c in pool[i:i + 8]) + ",")
+    print("};")
+    print()
+    print("// offset << 4 | length")
+    print("static const uint16_t string_table[NUM_STRINGS] = {")
+    for s in strings:
+        print("    (%d << 4) | %d," % (offsets[s], len(s)))
+    print("};")
+
+    sys.stderr.write("mkstrings: %d strings, %d UTF-16 units, %d bytes (%d bytes per key)\n"
+                     % (len(strings), len(pool), flash, per_key))
+
+if __name__ == "__main__":
+    main()